@@ -65,12 +65,31 @@ This library provides the following functions;
 - qoi_decode  -- decode the raw bytes of a QOI image from memory
 - qoi_write   -- encode and write a QOI file
 - qoi_encode  -- encode an rgba buffer into a QOI image in memory
+- qoi_probe   -- read only the header of a QOI image (also _file and _fd)
+- qoi_validate -- check a QOI image in memory without decoding it
 
 See the function declaration below for the signature and more information.
 
 If you don't want/need the qoi_read and qoi_write functions, you can define
 QOI_NO_STDIO before including this library.
 
+If you want to know how an image was en-/decoded, define QOI_STATS before
+including this library. This adds qoi_encode_stats and qoi_decode_stats, which
+count the emitted/read chunks in a qoi_stats struct. Without QOI_STATS the
+counting is compiled out entirely.
+
+On x86-64 with gcc or clang, SIMD kernels are compiled alongside the portable
+code and picked at runtime from the CPU's features, so one binary runs at full
+speed on new CPUs and stays correct on old ones. All variants produce identical
+output. Set the environment variable QOI_FORCE_ISA to scalar, sse2, sse42, avx2
+or avx512 to cap the selected level, e.g. for A/B testing. Define QOI_NO_SIMD to
+compile only the portable code.
+
+Define QOI_CRC to make the encoders append an integrity chunk (see below) with
+a CRC32C of the image, and qoi_decode and qoi_validate reject images whose
+chunk doesn't match. Images without the chunk are read as before. The CRC uses
+the SSE4.2 crc32 instruction where available.
+
 This library uses malloc() and free(). To supply your own malloc implementation
 you can define QOI_MALLOC and QOI_FREE before including this library.
 
@@ -122,6 +141,11 @@ presence of an 8-bit tag first.
 
 The byte stream's end is marked with 7 0x00 bytes followed a single 0x01 byte.
 
+It may be followed by an optional 8 byte integrity chunk, written and checked
+with QOI_CRC and ignored by other decoders: the tag "qcrc" and the CRC32C
+(Castagnoli polynomial, BE) of all bytes from the header up to and including
+the end marker.
+
 
 The possible chunks are:
 
@@ -284,6 +308,18 @@ The returned pixel data should be free()d after use. */
 
 void *qoi_read(const char *filename, qoi_desc *desc, int channels);
 
+
+/* Read only the 14 byte header of a QOI file, see qoi_probe. qoi_probe_fd
+reads it from the start of an open, seekable file and puts the file offset
+back afterwards (POSIX only).
+
+The functions return 1 and fill desc if the header is valid, 0 otherwise. */
+
+int qoi_probe_file(const char *filename, qoi_desc *desc);
+#if defined(__unix__) || defined(__APPLE__)
+int qoi_probe_fd(int fd, qoi_desc *desc);
+#endif
+
 #endif /* QOI_NO_STDIO */
 
 
@@ -309,6 +345,72 @@ The returned pixel data should be free()d after use. */
 void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 
 
+/* Read the description of a QOI image in memory from its header, without
+decoding it. Only the first 14 bytes are looked at, so data may hold just the
+start of the file.
+
+The function returns 1 and fills desc if the header is valid, 0 otherwise. */
+
+int qoi_probe(const void *data, int size, qoi_desc *desc);
+
+
+/* Check a QOI image in memory without decoding it: the header, that no chunk
+is cut off by the end of data, that the chunks describe exactly width * height
+pixels and that the padding follows them. Nothing is allocated and no pixels
+are stored. Data after the padding is not looked at, except for the integrity
+chunk with QOI_CRC.
+
+The function returns 0 if the image is invalid, otherwise the size in bytes
+of the image up to and including the padding. On success desc is filled with
+the description from the header. */
+
+int qoi_validate(const void *data, int size, qoi_desc *desc);
+
+
+#ifdef QOI_STATS
+
+/* Chunk counters for qoi_encode_stats, qoi_decode_stats and (in qoi_cpr.h)
+qoi_cpr_encode_stats. All counters are added to, so the same struct can be used
+to sum up several images; zero-initialize it before the first call.
+
+ops[] and op_bytes[] hold the number of chunks and the number of bytes
+(including the tag) for each QOI_STATS_OP_* type. index_lookups counts the
+pixels that were not covered by a QOI_OP_RUN, index_hits those of them that
+were found at their hash position in the index.
+
+The cpr_* counters are only filled by qoi_cpr_encode_stats: pixels that missed
+the hash position but were found by the scan over all 64 index entries, pixels
+that missed both, and the number of compare_color calls. */
+
+enum {
+	QOI_STATS_OP_RUN,
+	QOI_STATS_OP_INDEX,
+	QOI_STATS_OP_DIFF,
+	QOI_STATS_OP_LUMA,
+	QOI_STATS_OP_RGB,
+	QOI_STATS_OP_RGBA,
+	QOI_STATS_OP_COUNT
+};
+
+typedef struct {
+	unsigned long long ops[QOI_STATS_OP_COUNT];
+	unsigned long long op_bytes[QOI_STATS_OP_COUNT];
+	unsigned long long index_lookups;
+	unsigned long long index_hits;
+	unsigned long long cpr_scan_hits;
+	unsigned long long cpr_scan_misses;
+	unsigned long long cpr_compares;
+} qoi_stats;
+
+/* Same as qoi_encode and qoi_decode, but additionally count the chunks in
+stats. stats may be NULL. */
+
+void *qoi_encode_stats(const void *data, const qoi_desc *desc, int *out_len, qoi_stats *stats);
+void *qoi_decode_stats(const void *data, int size, qoi_desc *desc, int channels, qoi_stats *stats);
+
+#endif /* QOI_STATS */
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -330,6 +432,72 @@ Implementation */
 	#define QOI_ZEROARR(a) memset((a),0,sizeof(a))
 #endif
 
+/* The pixel loops are written once as force-inlined bodies and instantiated
+for each channel count, so per-pixel format checks fold away at compile time */
+#if defined(__GNUC__) || defined(__clang__)
+	#define QOI_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+	#define QOI_FORCE_INLINE __forceinline
+#else
+	#define QOI_FORCE_INLINE inline
+#endif
+
+/* Runtime CPU dispatch. SIMD variants are built with per-function target
+attributes; qoi_isa() detects the usable level once. Only x86-64 is covered,
+where scalar float math is SSE as well and results match bit for bit. */
+#if !defined(QOI_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	#define QOI_X86_DISPATCH
+	#include <immintrin.h>
+#endif
+
+enum {
+	QOI_ISA_SCALAR,
+	QOI_ISA_SSE2,
+	QOI_ISA_SSE42,
+	QOI_ISA_AVX2,
+	QOI_ISA_AVX512
+};
+
+/* Concurrent first calls all compute the same value, so the unsynchronized
+initialization is benign */
+static inline int qoi_isa(void) {
+	static int isa = -1;
+	if (isa < 0) {
+		int level = QOI_ISA_SCALAR;
+		const char *force = getenv("QOI_FORCE_ISA");
+
+		#ifdef QOI_X86_DISPATCH
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("sse2")) {
+				level = QOI_ISA_SSE2;
+			}
+			if (__builtin_cpu_supports("sse4.2")) {
+				level = QOI_ISA_SSE42;
+			}
+			if (__builtin_cpu_supports("avx2")) {
+				level = QOI_ISA_AVX2;
+			}
+			if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+				level = QOI_ISA_AVX512;
+			}
+		#endif
+
+		/* The override can only lower the level, never enable what the CPU
+		lacks */
+		if (force) {
+			int forced =
+				strcmp(force, "scalar") == 0 ? QOI_ISA_SCALAR :
+				strcmp(force, "sse2") == 0 ? QOI_ISA_SSE2 :
+				strcmp(force, "sse42") == 0 ? QOI_ISA_SSE42 :
+				strcmp(force, "avx2") == 0 ? QOI_ISA_AVX2 :
+				strcmp(force, "avx512") == 0 ? QOI_ISA_AVX512 : level;
+			level = (forced < level ? forced : level);
+		}
+		isa = level;
+	}
+	return isa;
+}
+
 #define QOI_OP_INDEX  0x00 /* 00xxxxxx */
 #define QOI_OP_DIFF   0x40 /* 01xxxxxx */
 #define QOI_OP_LUMA   0x80 /* 10xxxxxx */
@@ -339,6 +507,21 @@ Implementation */
 
 #define QOI_MASK_2    0xc0 /* 11000000 */
 
+#ifdef QOI_STATS
+	#define QOI_STATS_ADD(field, n) \
+		((void)(stats ? (stats->field += (n)) : 0))
+	#define QOI_STATS_OP(op, bytes) \
+		((void)(stats ? (stats->ops[op]++, stats->op_bytes[op] += (bytes)) : 0))
+	/* Thread the stats pointer through internal helpers */
+	#define QOI_STATS_PARAM , qoi_stats *stats
+	#define QOI_STATS_ARG , stats
+#else
+	#define QOI_STATS_ADD(field, n) ((void)0)
+	#define QOI_STATS_OP(op, bytes) ((void)0)
+	#define QOI_STATS_PARAM
+	#define QOI_STATS_ARG
+#endif
+
 #define QOI_COLOR_HASH(C) (C.rgba.r*3 + C.rgba.g*5 + C.rgba.b*7 + C.rgba.a*11)
 #define QOI_MAGIC \
 	(((unsigned int)'q') << 24 | ((unsigned int)'o') << 16 | \
@@ -373,42 +556,139 @@ static unsigned int qoi_read_32(const unsigned char *bytes, int *p) {
 	return a << 24 | b << 16 | c << 8 | d;
 }
 
-void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
-	int i, max_size, p, run;
-	int px_len, px_end, px_pos, channels;
-	unsigned char *bytes;
-	const unsigned char *pixels;
-	qoi_rgba_t index[64];
-	qoi_rgba_t px, px_prev;
+#ifdef QOI_CRC
+#define QOI_CRC_MAGIC \
+	(((unsigned int)'q') << 24 | ((unsigned int)'c') << 16 | \
+	 ((unsigned int)'r') <<  8 | ((unsigned int)'c'))
+#define QOI_CRC_SIZE 8
+
+/* CRC32C (reflected polynomial 0x82f63b78) of each byte value */
+static const unsigned int qoi_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
 
-	if (
-		data == NULL || out_len == NULL || desc == NULL ||
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		desc->height >= QOI_PIXELS_MAX / desc->width
-	) {
-		return NULL;
+static unsigned int qoi_crc32c_bytes(unsigned int crc, const unsigned char *bytes, int len) {
+	int i;
+	for (i = 0; i < len; i++) {
+		crc = qoi_crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
 	}
+	return crc;
+}
 
-	max_size =
-		desc->width * desc->height * (desc->channels + 1) +
-		QOI_HEADER_SIZE + sizeof(qoi_padding);
+#ifdef QOI_X86_DISPATCH
+__attribute__((target("sse4.2")))
+static unsigned int qoi_crc32c_sse42(unsigned int crc, const unsigned char *bytes, int len) {
+	unsigned long long c = crc;
+	int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		unsigned long long v;
+		memcpy(&v, bytes + i, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (unsigned int)c;
+	for (; i < len; i++) {
+		crc = _mm_crc32_u8(crc, bytes[i]);
+	}
+	return crc;
+}
+#endif
 
-	p = 0;
-	bytes = (unsigned char *) QOI_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
+static unsigned int qoi_crc32c(const unsigned char *bytes, int len) {
+	#ifdef QOI_X86_DISPATCH
+		if (qoi_isa() >= QOI_ISA_SSE42) {
+			return ~qoi_crc32c_sse42(0xffffffff, bytes, len);
+		}
+	#endif
+	return ~qoi_crc32c_bytes(0xffffffff, bytes, len);
+}
+
+/* Append the integrity chunk for bytes[0..p) */
+static int qoi_write_crc(unsigned char *bytes, int p) {
+	unsigned int crc = qoi_crc32c(bytes, p);
+	qoi_write_32(bytes, &p, QOI_CRC_MAGIC);
+	qoi_write_32(bytes, &p, crc);
+	return p;
+}
+
+/* Check the integrity chunk if one follows the end marker at end */
+static int qoi_check_crc(const unsigned char *bytes, int end, int size) {
+	int p = end;
+	if (end + QOI_CRC_SIZE > size || qoi_read_32(bytes, &p) != QOI_CRC_MAGIC) {
+		return 1;
 	}
+	return qoi_read_32(bytes, &p) == qoi_crc32c(bytes, end);
+}
+#else
+#define QOI_CRC_SIZE 0
+#endif
 
-	qoi_write_32(bytes, &p, QOI_MAGIC);
-	qoi_write_32(bytes, &p, desc->width);
-	qoi_write_32(bytes, &p, desc->height);
-	bytes[p++] = desc->channels;
-	bytes[p++] = desc->colorspace;
+/* Returns 1 if all pixels have r == g == b. Every byte is compared to the
+next one under a mask that keeps the r:g and g:b pairs; 48 bytes are a whole
+number of pixels for 3 and 4 channels, so the inner loop vectorizes. Stops at
+the first block that isn't gray, so color images cost next to nothing */
+static int qoi_is_gray(const unsigned char *pixels, int px_len, int channels) {
+	unsigned char mask[48];
+	int i, j, px_pos = 0;
 
+	for (j = 0; j < 48; j++) {
+		mask[j] = j % channels < 2 ? 0xff : 0;
+	}
+	while (px_pos + 48 < px_len) {
+		unsigned char diff = 0;
+		for (i = 0; i < 64 && px_pos + 48 < px_len; i++, px_pos += 48) {
+			for (j = 0; j < 48; j++) {
+				diff |= (pixels[px_pos + j] ^ pixels[px_pos + j + 1]) & mask[j];
+			}
+		}
+		if (diff) {
+			return 0;
+		}
+	}
+	for (; px_pos < px_len; px_pos += channels) {
+		if (pixels[px_pos] != pixels[px_pos + 1] || pixels[px_pos] != pixels[px_pos + 2]) {
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	pixels = (const unsigned char *)data;
+/* gray: all pixels have r == g == b (see qoi_is_gray), so vr == vg == vb and
+the LUMA chroma differences are always 0 */
+static QOI_FORCE_INLINE int qoi_encode_pixels(unsigned char *bytes, int p, const unsigned char *pixels, int px_len, const int channels, const int gray QOI_STATS_PARAM) {
+	int px_end, px_pos, run;
+	qoi_rgba_t index[64];
+	qoi_rgba_t px, px_prev;
 
 	QOI_ZEROARR(index);
 
@@ -419,14 +699,17 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 	px_prev.rgba.a = 255;
 	px = px_prev;
 
-	px_len = desc->width * desc->height * desc->channels;
-	px_end = px_len - desc->channels;
-	channels = desc->channels;
+	px_end = px_len - channels;
 
 	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		px.rgba.r = pixels[px_pos + 0];
-		px.rgba.g = pixels[px_pos + 1];
-		px.rgba.b = pixels[px_pos + 2];
+		if (gray) {
+			px.rgba.r = px.rgba.g = px.rgba.b = pixels[px_pos];
+		}
+		else {
+			px.rgba.r = pixels[px_pos + 0];
+			px.rgba.g = pixels[px_pos + 1];
+			px.rgba.b = pixels[px_pos + 2];
+		}
 
 		if (channels == 4) {
 			px.rgba.a = pixels[px_pos + 3];
@@ -436,6 +719,7 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 			run++;
 			if (run == 62 || px_pos == px_end) {
 				bytes[p++] = QOI_OP_RUN | (run - 1);
+				QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
 				run = 0;
 			}
 		}
@@ -444,18 +728,44 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 
 			if (run > 0) {
 				bytes[p++] = QOI_OP_RUN | (run - 1);
+				QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
 				run = 0;
 			}
 
-			index_pos = QOI_COLOR_HASH(px) % 64;
+			index_pos = gray ?
+				(px.rgba.g * 15 + px.rgba.a * 11) % 64 :
+				QOI_COLOR_HASH(px) % 64;
+			QOI_STATS_ADD(index_lookups, 1);
 
 			if (index[index_pos].v == px.v) {
 				bytes[p++] = QOI_OP_INDEX | index_pos;
+				QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+				QOI_STATS_ADD(index_hits, 1);
 			}
 			else {
 				index[index_pos] = px;
 
-				if (px.rgba.a == px_prev.rgba.a) {
+				if (gray && px.rgba.a == px_prev.rgba.a) {
+					signed char vg = px.rgba.g - px_prev.rgba.g;
+
+					if (vg > -3 && vg < 2) {
+						bytes[p++] = QOI_OP_DIFF | (vg + 2) << 4 | (vg + 2) << 2 | (vg + 2);
+						QOI_STATS_OP(QOI_STATS_OP_DIFF, 1);
+					}
+					else if (vg > -33 && vg < 32) {
+						bytes[p++] = QOI_OP_LUMA | (vg + 32);
+						bytes[p++] = 8 << 4 | 8;
+						QOI_STATS_OP(QOI_STATS_OP_LUMA, 2);
+					}
+					else {
+						bytes[p++] = QOI_OP_RGB;
+						bytes[p++] = px.rgba.r;
+						bytes[p++] = px.rgba.g;
+						bytes[p++] = px.rgba.b;
+						QOI_STATS_OP(QOI_STATS_OP_RGB, 4);
+					}
+				}
+				else if (px.rgba.a == px_prev.rgba.a) {
 					signed char vr = px.rgba.r - px_prev.rgba.r;
 					signed char vg = px.rgba.g - px_prev.rgba.g;
 					signed char vb = px.rgba.b - px_prev.rgba.b;
@@ -469,6 +779,7 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 						vb > -3 && vb < 2
 					) {
 						bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+						QOI_STATS_OP(QOI_STATS_OP_DIFF, 1);
 					}
 					else if (
 						vg_r >  -9 && vg_r <  8 &&
@@ -477,12 +788,14 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 					) {
 						bytes[p++] = QOI_OP_LUMA     | (vg   + 32);
 						bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
+						QOI_STATS_OP(QOI_STATS_OP_LUMA, 2);
 					}
 					else {
 						bytes[p++] = QOI_OP_RGB;
 						bytes[p++] = px.rgba.r;
 						bytes[p++] = px.rgba.g;
 						bytes[p++] = px.rgba.b;
+						QOI_STATS_OP(QOI_STATS_OP_RGB, 4);
 					}
 				}
 				else {
@@ -491,65 +804,105 @@ void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
 					bytes[p++] = px.rgba.g;
 					bytes[p++] = px.rgba.b;
 					bytes[p++] = px.rgba.a;
+					QOI_STATS_OP(QOI_STATS_OP_RGBA, 5);
 				}
 			}
 		}
 		px_prev = px;
 	}
 
-	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
-		bytes[p++] = qoi_padding[i];
-	}
+	return p;
+}
 
-	*out_len = p;
-	return bytes;
+static int qoi_encode_pixels_rgb(unsigned char *bytes, int p, const unsigned char *pixels, int px_len QOI_STATS_PARAM) {
+	return qoi_encode_pixels(bytes, p, pixels, px_len, 3, 0 QOI_STATS_ARG);
 }
 
-void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
-	const unsigned char *bytes;
-	unsigned int header_magic;
-	unsigned char *pixels;
-	qoi_rgba_t index[64];
-	qoi_rgba_t px;
-	int px_len, chunks_len, px_pos;
-	int p = 0, run = 0;
+static int qoi_encode_pixels_rgba(unsigned char *bytes, int p, const unsigned char *pixels, int px_len QOI_STATS_PARAM) {
+	return qoi_encode_pixels(bytes, p, pixels, px_len, 4, 0 QOI_STATS_ARG);
+}
 
-	if (
-		data == NULL || desc == NULL ||
-		(channels != 0 && channels != 3 && channels != 4) ||
-		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
-	) {
-		return NULL;
-	}
+static int qoi_encode_pixels_gray(unsigned char *bytes, int p, const unsigned char *pixels, int px_len QOI_STATS_PARAM) {
+	return qoi_encode_pixels(bytes, p, pixels, px_len, 3, 1 QOI_STATS_ARG);
+}
 
-	bytes = (const unsigned char *)data;
+static int qoi_encode_pixels_gray_alpha(unsigned char *bytes, int p, const unsigned char *pixels, int px_len QOI_STATS_PARAM) {
+	return qoi_encode_pixels(bytes, p, pixels, px_len, 4, 1 QOI_STATS_ARG);
+}
 
-	header_magic = qoi_read_32(bytes, &p);
-	desc->width = qoi_read_32(bytes, &p);
-	desc->height = qoi_read_32(bytes, &p);
-	desc->channels = bytes[p++];
-	desc->colorspace = bytes[p++];
+#ifdef QOI_STATS
+void *qoi_encode_stats(const void *data, const qoi_desc *desc, int *out_len, qoi_stats *stats) {
+#else
+void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
+#endif
+	int i, max_size, p, px_len;
+	unsigned char *bytes;
+	const unsigned char *pixels;
 
 	if (
+		data == NULL || out_len == NULL || desc == NULL ||
 		desc->width == 0 || desc->height == 0 ||
 		desc->channels < 3 || desc->channels > 4 ||
 		desc->colorspace > 1 ||
-		header_magic != QOI_MAGIC ||
 		desc->height >= QOI_PIXELS_MAX / desc->width
 	) {
 		return NULL;
 	}
 
-	if (channels == 0) {
-		channels = desc->channels;
-	}
+	max_size =
+		desc->width * desc->height * (desc->channels + 1) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding) + QOI_CRC_SIZE;
 
-	px_len = desc->width * desc->height * channels;
-	pixels = (unsigned char *) QOI_MALLOC(px_len);
-	if (!pixels) {
+	p = 0;
+	bytes = (unsigned char *) QOI_MALLOC(max_size);
+	if (!bytes) {
 		return NULL;
 	}
 
+	qoi_write_32(bytes, &p, QOI_MAGIC);
+	qoi_write_32(bytes, &p, desc->width);
+	qoi_write_32(bytes, &p, desc->height);
+	bytes[p++] = desc->channels;
+	bytes[p++] = desc->colorspace;
+
+
+	pixels = (const unsigned char *)data;
+
+	px_len = desc->width * desc->height * desc->channels;
+	if (qoi_is_gray(pixels, px_len, desc->channels)) {
+		p = desc->channels == 4 ?
+			qoi_encode_pixels_gray_alpha(bytes, p, pixels, px_len QOI_STATS_ARG) :
+			qoi_encode_pixels_gray(bytes, p, pixels, px_len QOI_STATS_ARG);
+	}
+	else {
+		p = desc->channels == 4 ?
+			qoi_encode_pixels_rgba(bytes, p, pixels, px_len QOI_STATS_ARG) :
+			qoi_encode_pixels_rgb(bytes, p, pixels, px_len QOI_STATS_ARG);
+	}
+
+	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
+		bytes[p++] = qoi_padding[i];
+	}
+	#ifdef QOI_CRC
+		p = qoi_write_crc(bytes, p);
+	#endif
+
+	*out_len = p;
+	return bytes;
+}
+
+#ifdef QOI_STATS
+void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
+	return qoi_encode_stats(data, desc, out_len, NULL);
+}
+#endif
+
+static QOI_FORCE_INLINE void qoi_decode_pixels(const unsigned char *bytes, int size, unsigned char *pixels, int px_len, const int channels QOI_STATS_PARAM) {
+	qoi_rgba_t index[64];
+	qoi_rgba_t px;
+	int chunks_len, px_pos;
+	int p = QOI_HEADER_SIZE, run = 0;
+
 	QOI_ZEROARR(index);
 	px.rgba.r = 0;
 	px.rgba.g = 0;
@@ -568,20 +921,29 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
 				px.rgba.r = bytes[p++];
 				px.rgba.g = bytes[p++];
 				px.rgba.b = bytes[p++];
+				QOI_STATS_OP(QOI_STATS_OP_RGB, 4);
+				QOI_STATS_ADD(index_lookups, 1);
 			}
 			else if (b1 == QOI_OP_RGBA) {
 				px.rgba.r = bytes[p++];
 				px.rgba.g = bytes[p++];
 				px.rgba.b = bytes[p++];
 				px.rgba.a = bytes[p++];
+				QOI_STATS_OP(QOI_STATS_OP_RGBA, 5);
+				QOI_STATS_ADD(index_lookups, 1);
 			}
 			else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
 				px = index[b1];
+				QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+				QOI_STATS_ADD(index_lookups, 1);
+				QOI_STATS_ADD(index_hits, 1);
 			}
 			else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
 				px.rgba.r += ((b1 >> 4) & 0x03) - 2;
 				px.rgba.g += ((b1 >> 2) & 0x03) - 2;
 				px.rgba.b += ( b1       & 0x03) - 2;
+				QOI_STATS_OP(QOI_STATS_OP_DIFF, 1);
+				QOI_STATS_ADD(index_lookups, 1);
 			}
 			else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
 				int b2 = bytes[p++];
@@ -589,9 +951,12 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
 				px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
 				px.rgba.g += vg;
 				px.rgba.b += vg - 8 +  (b2       & 0x0f);
+				QOI_STATS_OP(QOI_STATS_OP_LUMA, 2);
+				QOI_STATS_ADD(index_lookups, 1);
 			}
 			else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
 				run = (b1 & 0x3f);
+				QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
 			}
 
 			index[QOI_COLOR_HASH(px) % 64] = px;
@@ -605,10 +970,326 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
 			pixels[px_pos + 3] = px.rgba.a;
 		}
 	}
+}
+
+static void qoi_decode_pixels_rgb(const unsigned char *bytes, int size, unsigned char *pixels, int px_len QOI_STATS_PARAM) {
+	qoi_decode_pixels(bytes, size, pixels, px_len, 3 QOI_STATS_ARG);
+}
+
+static void qoi_decode_pixels_rgba(const unsigned char *bytes, int size, unsigned char *pixels, int px_len QOI_STATS_PARAM) {
+	qoi_decode_pixels(bytes, size, pixels, px_len, 4 QOI_STATS_ARG);
+}
+
+/* Fill desc from the QOI_HEADER_SIZE bytes of a header, return 1 if it is
+valid */
+static int qoi_read_header(const unsigned char *bytes, qoi_desc *desc) {
+	unsigned int header_magic;
+	int p = 0;
+
+	header_magic = qoi_read_32(bytes, &p);
+	desc->width = qoi_read_32(bytes, &p);
+	desc->height = qoi_read_32(bytes, &p);
+	desc->channels = bytes[p++];
+	desc->colorspace = bytes[p++];
+
+	return !(
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4 ||
+		desc->colorspace > 1 ||
+		header_magic != QOI_MAGIC ||
+		desc->height >= QOI_PIXELS_MAX / desc->width
+	);
+}
+
+#ifdef QOI_STATS
+void *qoi_decode_stats(const void *data, int size, qoi_desc *desc, int channels, qoi_stats *stats) {
+#else
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
+#endif
+	const unsigned char *bytes;
+	unsigned char *pixels;
+	int px_len;
+
+	if (
+		data == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+	) {
+		return NULL;
+	}
+
+	bytes = (const unsigned char *)data;
+
+	if (!qoi_read_header(bytes, desc)) {
+		return NULL;
+	}
+
+	/* A stream ends with the end marker, so a trailing integrity chunk sits
+	at the very end */
+	#ifdef QOI_CRC
+		if (
+			size >= QOI_HEADER_SIZE + (int)sizeof(qoi_padding) + QOI_CRC_SIZE &&
+			!qoi_check_crc(bytes, size - QOI_CRC_SIZE, size)
+		) {
+			return NULL;
+		}
+	#endif
+
+	if (channels == 0) {
+		channels = desc->channels;
+	}
+
+	px_len = desc->width * desc->height * channels;
+	pixels = (unsigned char *) QOI_MALLOC(px_len);
+	if (!pixels) {
+		return NULL;
+	}
+
+	if (channels == 4) {
+		qoi_decode_pixels_rgba(bytes, size, pixels, px_len QOI_STATS_ARG);
+	}
+	else {
+		qoi_decode_pixels_rgb(bytes, size, pixels, px_len QOI_STATS_ARG);
+	}
 
 	return pixels;
 }
 
+#ifdef QOI_STATS
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
+	return qoi_decode_stats(data, size, desc, channels, NULL);
+}
+#endif
+
+int qoi_probe(const void *data, int size, qoi_desc *desc) {
+	if (data == NULL || desc == NULL || size < QOI_HEADER_SIZE) {
+		return 0;
+	}
+	return qoi_read_header((const unsigned char *)data, desc);
+}
+
+/* Chunk length by its first byte, for qoi_validate */
+#define QOI_LEN16(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+static const unsigned char qoi_op_len[256] = {
+	QOI_LEN16(1), QOI_LEN16(1), QOI_LEN16(1), QOI_LEN16(1), /* INDEX */
+	QOI_LEN16(1), QOI_LEN16(1), QOI_LEN16(1), QOI_LEN16(1), /* DIFF */
+	QOI_LEN16(2), QOI_LEN16(2), QOI_LEN16(2), QOI_LEN16(2), /* LUMA */
+	QOI_LEN16(1), QOI_LEN16(1), QOI_LEN16(1),               /* RUN */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 4, 5          /* RUN, RGB, RGBA */
+};
+
+/* Skips whole chunks from the chunk boundary p as long as they end well
+before end, adding their pixels to *px_count but stopping short of
+px_total. Returns the chunk boundary it stopped at; the scalar loop in
+qoi_validate does the rest. */
+typedef int (*qoi_validate_fn)(const unsigned char *bytes, int p, int end, unsigned int *px_count, unsigned int px_total);
+
+#ifdef QOI_X86_DISPATCH
+/* The byte stream is cut into blocks of 16. A chunk starting in a block
+spills at most 4 bytes into the next, so a block is entered at offset 0..4.
+For every offset in a block the chain of chunks is followed to the block's
+end at once by pointer doubling: next[i] = next[next[i]], while the exit
+offset and the pixel count (a 16 bit sum in two byte planes) are gathered
+along. Blocks are independent, so only picking each block's entry is left
+as a serial step. */
+__attribute__((target("avx2")))
+static int qoi_validate_chunks_avx2(const unsigned char *bytes, int p, int end, unsigned int *px_count, unsigned int px_total) {
+	const __m256i lane = _mm256_setr_epi8(
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+	);
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i c15 = _mm256_set1_epi8(15);
+	const __m256i c16 = _mm256_set1_epi8(16);
+	const __m256i mask2 = _mm256_set1_epi8((char)QOI_MASK_2);
+	const __m256i sentinel = _mm256_set1_epi8((char)0x80);
+	unsigned char exit_ofs[256], sum_lo[256], sum_hi[256];
+	unsigned int px = *px_count;
+	int e = 0;
+
+	/* 256 bytes per round, the last chunk may spill 4 more */
+	while (p + 256 + 4 <= end) {
+		int k;
+		for (k = 0; k < 256; k += 32) {
+			__m256i b = _mm256_loadu_si256((const __m256i *)(bytes + p + k));
+			__m256i op2 = _mm256_and_si256(b, mask2);
+			__m256i rgb = _mm256_cmpeq_epi8(b, _mm256_set1_epi8((char)QOI_OP_RGB));
+			__m256i rgba = _mm256_cmpeq_epi8(b, _mm256_set1_epi8((char)QOI_OP_RGBA));
+			__m256i luma = _mm256_cmpeq_epi8(op2, _mm256_set1_epi8((char)QOI_OP_LUMA));
+			__m256i run = _mm256_andnot_si256(_mm256_or_si256(rgb, rgba), _mm256_cmpeq_epi8(op2, mask2));
+
+			__m256i len = _mm256_sub_epi8(one, luma);
+			len = _mm256_add_epi8(len, _mm256_and_si256(rgb, _mm256_set1_epi8(3)));
+			len = _mm256_add_epi8(len, _mm256_and_si256(rgba, _mm256_set1_epi8(4)));
+
+			/* Chunks leaving the block point to the sentinel (high bit set,
+			gathers 0) and hold their exit offset */
+			__m256i next = _mm256_add_epi8(lane, len);
+			__m256i out = _mm256_cmpgt_epi8(next, c15);
+			__m256i nx = _mm256_or_si256(next, _mm256_and_si256(out, sentinel));
+			__m256i ex = _mm256_and_si256(out, _mm256_sub_epi8(next, c16));
+			__m256i lo = _mm256_add_epi8(one, _mm256_and_si256(run, _mm256_andnot_si256(mask2, b)));
+			__m256i hi = _mm256_setzero_si256();
+			int step;
+
+			for (step = 0; step < 4; step++) {
+				__m256i glo = _mm256_shuffle_epi8(lo, nx);
+				__m256i ghi = _mm256_shuffle_epi8(hi, nx);
+				__m256i nocarry;
+				ex = _mm256_or_si256(ex, _mm256_shuffle_epi8(ex, nx));
+				lo = _mm256_add_epi8(lo, glo);
+				nocarry = _mm256_cmpeq_epi8(_mm256_max_epu8(lo, glo), lo);
+				hi = _mm256_add_epi8(_mm256_add_epi8(hi, ghi), _mm256_add_epi8(nocarry, one));
+				nx = _mm256_or_si256(_mm256_shuffle_epi8(nx, nx), _mm256_and_si256(nx, sentinel));
+			}
+			_mm256_storeu_si256((__m256i *)(exit_ofs + k), ex);
+			_mm256_storeu_si256((__m256i *)(sum_lo + k), lo);
+			_mm256_storeu_si256((__m256i *)(sum_hi + k), hi);
+		}
+
+		for (k = 0; k < 256; k += 16) {
+			unsigned int n = sum_lo[k + e] | (sum_hi[k + e] << 8);
+			if (px + n >= px_total) {
+				*px_count = px;
+				return p + k + e;
+			}
+			px += n;
+			e = exit_ofs[k + e];
+		}
+		p += 256;
+	}
+	*px_count = px;
+	return p + e;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int qoi_validate_chunks_avx512(const unsigned char *bytes, int p, int end, unsigned int *px_count, unsigned int px_total) {
+	const __m512i lane = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	const __m512i one = _mm512_set1_epi8(1);
+	const __m512i c15 = _mm512_set1_epi8(15);
+	const __m512i c16 = _mm512_set1_epi8(16);
+	const __m512i mask2 = _mm512_set1_epi8((char)QOI_MASK_2);
+	const __m512i sentinel = _mm512_set1_epi8((char)0x80);
+	unsigned char exit_ofs[256], sum_lo[256], sum_hi[256];
+	unsigned int px = *px_count;
+	int e = 0;
+
+	while (p + 256 + 4 <= end) {
+		int k;
+		for (k = 0; k < 256; k += 64) {
+			__m512i b = _mm512_loadu_si512((const void *)(bytes + p + k));
+			__m512i op2 = _mm512_and_si512(b, mask2);
+			__mmask64 rgb = _mm512_cmpeq_epi8_mask(b, _mm512_set1_epi8((char)QOI_OP_RGB));
+			__mmask64 rgba = _mm512_cmpeq_epi8_mask(b, _mm512_set1_epi8((char)QOI_OP_RGBA));
+			__mmask64 luma = _mm512_cmpeq_epi8_mask(op2, _mm512_set1_epi8((char)QOI_OP_LUMA));
+			__mmask64 run = _mm512_cmpeq_epi8_mask(op2, mask2) & ~(rgb | rgba);
+
+			__m512i len = _mm512_mask_mov_epi8(one, luma, _mm512_set1_epi8(2));
+			len = _mm512_mask_mov_epi8(len, rgb, _mm512_set1_epi8(4));
+			len = _mm512_mask_mov_epi8(len, rgba, _mm512_set1_epi8(5));
+
+			__m512i next = _mm512_add_epi8(lane, len);
+			__mmask64 out = _mm512_cmpgt_epu8_mask(next, c15);
+			__m512i nx = _mm512_or_si512(next, _mm512_maskz_mov_epi8(out, sentinel));
+			__m512i ex = _mm512_maskz_sub_epi8(out, next, c16);
+			__m512i lo = _mm512_mask_add_epi8(one, run, one, _mm512_andnot_si512(mask2, b));
+			__m512i hi = _mm512_setzero_si512();
+			int step;
+
+			for (step = 0; step < 4; step++) {
+				__m512i glo = _mm512_shuffle_epi8(lo, nx);
+				__m512i ghi = _mm512_shuffle_epi8(hi, nx);
+				__mmask64 carry;
+				ex = _mm512_or_si512(ex, _mm512_shuffle_epi8(ex, nx));
+				lo = _mm512_add_epi8(lo, glo);
+				carry = _mm512_cmplt_epu8_mask(lo, glo);
+				hi = _mm512_mask_add_epi8(_mm512_add_epi8(hi, ghi), carry, _mm512_add_epi8(hi, ghi), one);
+				nx = _mm512_or_si512(_mm512_shuffle_epi8(nx, nx), _mm512_and_si512(nx, sentinel));
+			}
+			_mm512_storeu_si512((void *)(exit_ofs + k), ex);
+			_mm512_storeu_si512((void *)(sum_lo + k), lo);
+			_mm512_storeu_si512((void *)(sum_hi + k), hi);
+		}
+
+		for (k = 0; k < 256; k += 16) {
+			unsigned int n = sum_lo[k + e] | (sum_hi[k + e] << 8);
+			if (px + n >= px_total) {
+				*px_count = px;
+				return p + k + e;
+			}
+			px += n;
+			e = exit_ofs[k + e];
+		}
+		p += 256;
+	}
+	*px_count = px;
+	return p + e;
+}
+#endif /* QOI_X86_DISPATCH */
+
+/* Returns the fastest chunk skipper for this CPU, or NULL for the scalar
+loop alone */
+static qoi_validate_fn qoi_validate_select(void) {
+	#ifdef QOI_X86_DISPATCH
+		switch (qoi_isa()) {
+			case QOI_ISA_AVX512: return qoi_validate_chunks_avx512;
+			case QOI_ISA_AVX2: return qoi_validate_chunks_avx2;
+		}
+	#endif
+	return NULL;
+}
+
+int qoi_validate(const void *data, int size, qoi_desc *desc) {
+	const unsigned char *bytes;
+	unsigned int px_count, px_total;
+	qoi_validate_fn skip;
+	int p = QOI_HEADER_SIZE;
+
+	if (
+		data == NULL || desc == NULL ||
+		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+	) {
+		return 0;
+	}
+
+	bytes = (const unsigned char *)data;
+	if (!qoi_read_header(bytes, desc)) {
+		return 0;
+	}
+
+	/* Only the length and the pixel count of each chunk matter, colors and
+	the index are never looked at */
+	px_total = desc->width * desc->height;
+	px_count = 0;
+	skip = qoi_validate_select();
+	if (skip) {
+		p = skip(bytes, p, size, &px_count, px_total);
+	}
+	while (px_count < px_total) {
+		int b1;
+		if (p >= size) {
+			return 0;
+		}
+		b1 = bytes[p];
+		p += qoi_op_len[b1];
+		px_count += (unsigned int)(b1 - QOI_OP_RUN) < 62 ? b1 - QOI_OP_RUN + 1 : 1;
+	}
+
+	if (
+		px_count != px_total ||
+		p + (int)sizeof(qoi_padding) > size ||
+		memcmp(bytes + p, qoi_padding, sizeof(qoi_padding)) != 0
+	) {
+		return 0;
+	}
+	#ifdef QOI_CRC
+		if (!qoi_check_crc(bytes, p + (int)sizeof(qoi_padding), size)) {
+			return 0;
+		}
+	#endif
+	return p + (int)sizeof(qoi_padding);
+}
+
 #ifndef QOI_NO_STDIO
 #include <stdio.h>
 
@@ -665,5 +1346,42 @@ void *qoi_read(const char *filename, qoi_desc *desc, int channels) {
 	return pixels;
 }
 
+int qoi_probe_file(const char *filename, qoi_desc *desc) {
+	FILE *f = fopen(filename, "rb");
+	unsigned char header[QOI_HEADER_SIZE];
+	int bytes_read;
+
+	if (!f) {
+		return 0;
+	}
+
+	bytes_read = fread(header, 1, QOI_HEADER_SIZE, f);
+	fclose(f);
+	return qoi_probe(header, bytes_read, desc);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+
+int qoi_probe_fd(int fd, qoi_desc *desc) {
+	unsigned char header[QOI_HEADER_SIZE];
+	long pos = (long)lseek(fd, 0, SEEK_CUR);
+	int bytes_read = 0;
+
+	if (pos < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		return 0;
+	}
+	while (bytes_read < QOI_HEADER_SIZE) {
+		int n = (int)read(fd, header + bytes_read, QOI_HEADER_SIZE - bytes_read);
+		if (n <= 0) {
+			break;
+		}
+		bytes_read += n;
+	}
+	lseek(fd, pos, SEEK_SET);
+	return qoi_probe(header, bytes_read, desc);
+}
+#endif
+
 #endif /* QOI_NO_STDIO */
 #endif /* QOI_IMPLEMENTATION */
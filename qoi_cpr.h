@@ -40,11 +40,30 @@ Header - Public functions */
 extern "C" {
 #endif
 
+/* Search effort of the encoder, see qoi_cpr_cfg.effort */
+#define QOI_CPR_EFFORT_DEFAULT   0 /* same as QOI_CPR_EFFORT_NORMAL */
+#define QOI_CPR_EFFORT_FAST      1 /* only the hash slot and recently used slots */
+#define QOI_CPR_EFFORT_NORMAL    2 /* scan all 64 index slots */
+#define QOI_CPR_EFFORT_LOOKAHEAD 3 /* prefer colors that also cover the next pixel */
+#define QOI_CPR_EFFORT_TRELLIS   4 /* minimize bytes over windows of pixels */
+
+/* Color space in which the color error is measured, see qoi_cpr_cfg.space */
+#define QOI_CPR_SPACE_RGB   0
+#define QOI_CPR_SPACE_YCOCG 1 /* weights[0..2] apply to Y, Co, Cg */
+
 typedef struct {
 	float weights[4];
 	float lothresh;
 	float hithresh;
 	int mulalpha;
+	int effort;
+	int protect;
+	int vertical;
+	const float *map;
+	int map_block;
+	int map_stride;
+	int space;
+	int tone;
 } qoi_cpr_cfg;
 
 #ifndef QOI_NO_STDIO
@@ -53,7 +72,28 @@ typedef struct {
 system. The qoi_desc struct must be filled with the image width, height,
 number of channels (3 = RGB, 4 = RGBA) and the colorspace. The qoi_cpr_cfg struct
 must be filled with the RGBA channel weights, low contrast threshhold, low contrast
-threshhold and multiply alpha mode.
+threshhold and multiply alpha mode. effort trades encode speed for size; leave
+it 0 for the default. protect = 1 stores new colors off index slots that are
+hit often, where an in-tolerance alternative of the same size allows it (not
+used by QOI_CPR_EFFORT_TRELLIS). vertical = 1 also takes the pixels above and
+below into account for the local contrast.
+
+map optionally scales the thresholds per block of map_block x map_block pixels
+(8 if 0), e.g. 0 to keep a region of interest lossless and 2 or more for the
+background. It holds (height + map_block - 1) / map_block rows that start
+map_stride values apart, of which the first (width + map_block - 1) / map_block
+are used. map_stride = 0 means exactly that many; a smaller non-zero stride
+fails the encode. Negative and NaN values count as 0. NULL scales nothing.
+
+space = QOI_CPR_SPACE_YCOCG measures the color error as luma (Y) and chroma
+(Co, Cg) of YCoCg-R instead of R, G, B, so the first three weights set the
+luma and chroma tolerance, e.g. 100, 40, 40.
+
+tone = 1 scales the color threshold of every pixel by how little a step of
+its luma code value changes the perceived lightness (CIE L*), following
+desc->colorspace. This allows more error in the bright tones of QOI_LINEAR
+images and less in their dark tones, so both colorspaces give about the same
+visual quality at the same settings. sRGB images change only slightly.
 
 The function returns 0 on failure (invalid parameters, or fopen or malloc
 failed) or the number of bytes written on success. */
@@ -74,6 +114,16 @@ The returned qoi data should be free()d after use. */
 void *qoi_cpr_encode(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int *out_len);
 
 
+#ifdef QOI_STATS
+
+/* Same as qoi_cpr_encode, but additionally count the emitted chunks, the index
+hits and misses and the compare_color calls in stats. stats may be NULL. */
+
+void *qoi_cpr_encode_stats(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int *out_len, qoi_stats *stats);
+
+#endif /* QOI_STATS */
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -92,13 +142,32 @@ Implementation */
 #define QOI_CPR_MIN(a,b) ((a) < (b) ? (a) : (b))
 #define QOI_CPR_CLAMP(a,l,h) ((a) < (l) ? (l) : (a) > (h) ? (h) : (a))
 
-inline int compare_color(const qoi_rgba_t px, const float alpha, const qoi_rgba_t px_cmp, const float *thresh, const qoi_cpr_cfg *cfg, float *score) {
-	float diff[4] = {
-		abs(px.rgba.r - px_cmp.rgba.r) * cfg->weights[0] * alpha,
-		abs(px.rgba.g - px_cmp.rgba.g) * cfg->weights[1] * alpha,
-		abs(px.rgba.b - px_cmp.rgba.b) * cfg->weights[2] * alpha,
-		abs(px.rgba.a - px_cmp.rgba.a) * cfg->weights[3]
-	};
+/* Magnitude of the YCoCg-R components of a color difference. Lifted in int
+and scaled after the conversion, so the SIMD variants give the same results */
+#define QOI_CPR_YCOCG(dr, dg, db, y, co, cg) \
+	y = abs(dr + dg + dg + db) * 0.25f; \
+	co = abs(dr - db); \
+	cg = abs(dg + dg - dr - db) * 0.5f
+
+static QOI_FORCE_INLINE int compare_color(const qoi_rgba_t px, const float alpha, const qoi_rgba_t px_cmp, const float *thresh, const qoi_cpr_cfg *cfg, float *score) {
+	float diff[4];
+
+	if (cfg->space == QOI_CPR_SPACE_YCOCG) {
+		int dr = px.rgba.r - px_cmp.rgba.r;
+		int dg = px.rgba.g - px_cmp.rgba.g;
+		int db = px.rgba.b - px_cmp.rgba.b;
+		float y, co, cg;
+		QOI_CPR_YCOCG(dr, dg, db, y, co, cg);
+		diff[0] = y * cfg->weights[0] * alpha;
+		diff[1] = co * cfg->weights[1] * alpha;
+		diff[2] = cg * cfg->weights[2] * alpha;
+	}
+	else {
+		diff[0] = abs(px.rgba.r - px_cmp.rgba.r) * cfg->weights[0] * alpha;
+		diff[1] = abs(px.rgba.g - px_cmp.rgba.g) * cfg->weights[1] * alpha;
+		diff[2] = abs(px.rgba.b - px_cmp.rgba.b) * cfg->weights[2] * alpha;
+	}
+	diff[3] = abs(px.rgba.a - px_cmp.rgba.a) * cfg->weights[3];
 
 	if (score) {
 		*score = diff[0] + diff[1] + diff[2] + diff[3];
@@ -110,107 +179,1340 @@ inline int compare_color(const qoi_rgba_t px, const float alpha, const qoi_rgba_
 		diff[3] <= thresh[1];
 }
 
-void *qoi_cpr_encode(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int *out_len) {
-	int i, max_size, p, run;
-	int px_len, px_end, px_pos, channels;
-	float diff_prev[2], diff_next[2], local_thresh[2];
-	unsigned char *bytes;
-	const unsigned char *pixels;
-	qoi_rgba_t index[64];
-	unsigned long long mask;
-	qoi_rgba_t px, px_prev, px_next, px_stored, px_potential;
-	float alpha, diff_sum;
+/* Find the valid index entry closest to px that is within tolerance.
+Returns -1 if there is none */
+static QOI_FORCE_INLINE int qoi_cpr_scan_index(const qoi_rgba_t *index, unsigned long long mask, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	float score_min = QOI_CPR_MAXFLOAT;
+	float score;
+	int i, index_pos = -1;
+
+	for (i = 0; i < 64; i++) {
+		if (
+			/* Make sure color is valid
+			The behavior to update the index of invalid color is undefined */
+			(mask & ((unsigned long long)1 << i)) &&
+			(QOI_STATS_ADD(cpr_compares, 1), compare_color(px, alpha, index[i], thresh, cfg, &score)) &&
+			score < score_min
+		) {
+			score_min = score;
+			index_pos = i;
+		}
+	}
+
+	return index_pos;
+}
+
+/* SIMD variants of qoi_cpr_scan_index. Each lane computes the same float
+operations in the same order as compare_color, failing or invalid entries get
+QOI_CPR_MAXFLOAT and the first entry with the minimum score wins, so the
+result is identical to the scalar scan. */
+typedef int (*qoi_cpr_scan_fn)(const qoi_rgba_t *index, unsigned long long mask, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg);
+
+#ifdef QOI_X86_DISPATCH
+__attribute__((target("sse2")))
+static int qoi_cpr_scan_index_sse2(const qoi_rgba_t *index, unsigned long long mask, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg) {
+	const __m128i pxv = _mm_set1_epi32(px.v);
+	const __m128i lo8 = _mm_set1_epi32(0xff);
+	const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+	const __m128 w0 = _mm_set1_ps(cfg->weights[0]), w1 = _mm_set1_ps(cfg->weights[1]);
+	const __m128 w2 = _mm_set1_ps(cfg->weights[2]), w3 = _mm_set1_ps(cfg->weights[3]);
+	const __m128 av = _mm_set1_ps(alpha);
+	const __m128 t0 = _mm_set1_ps(thresh[0]), t1 = _mm_set1_ps(thresh[1]);
+	const __m128 maxv = _mm_set1_ps(QOI_CPR_MAXFLOAT);
+	const __m128 sign = _mm_set1_ps(-0.f), half = _mm_set1_ps(0.5f), quarter = _mm_set1_ps(0.25f);
+	const __m128i pr = _mm_set1_epi32(px.rgba.r), pg = _mm_set1_epi32(px.rgba.g), pb = _mm_set1_epi32(px.rgba.b);
+	const int ycocg = cfg->space == QOI_CPR_SPACE_YCOCG;
+	__m128 scores[16];
+	__m128 minv = maxv;
+	float score_min;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(index + i * 4));
+		__m128i ad = _mm_or_si128(_mm_subs_epu8(v, pxv), _mm_subs_epu8(pxv, v));
+		__m128 dr, dg, db;
+		if (ycocg) {
+			__m128i sr = _mm_sub_epi32(pr, _mm_and_si128(v, lo8));
+			__m128i sg = _mm_sub_epi32(pg, _mm_and_si128(_mm_srli_epi32(v, 8), lo8));
+			__m128i sb = _mm_sub_epi32(pb, _mm_and_si128(_mm_srli_epi32(v, 16), lo8));
+			__m128i srb = _mm_add_epi32(sr, sb), sg2 = _mm_add_epi32(sg, sg);
+			__m128 y = _mm_mul_ps(_mm_andnot_ps(sign, _mm_cvtepi32_ps(_mm_add_epi32(srb, sg2))), quarter);
+			__m128 co = _mm_andnot_ps(sign, _mm_cvtepi32_ps(_mm_sub_epi32(sr, sb)));
+			__m128 cg = _mm_mul_ps(_mm_andnot_ps(sign, _mm_cvtepi32_ps(_mm_sub_epi32(sg2, srb))), half);
+			dr = _mm_mul_ps(_mm_mul_ps(y, w0), av);
+			dg = _mm_mul_ps(_mm_mul_ps(co, w1), av);
+			db = _mm_mul_ps(_mm_mul_ps(cg, w2), av);
+		}
+		else {
+			dr = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(ad, lo8)), w0), av);
+			dg = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(ad, 8), lo8)), w1), av);
+			db = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(ad, 16), lo8)), w2), av);
+		}
+		__m128 da = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(ad, 24)), w3);
+		__m128 score = _mm_add_ps(_mm_add_ps(_mm_add_ps(dr, dg), db), da);
+
+		__m128i valid = _mm_and_si128(_mm_set1_epi32((int)(mask >> (i * 4)) & 0xf), bits);
+		__m128 ok = _mm_castsi128_ps(_mm_cmpeq_epi32(valid, bits));
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmple_ps(dr, t0), _mm_cmple_ps(dg, t0)));
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmple_ps(db, t0), _mm_cmple_ps(da, t1)));
+
+		scores[i] = _mm_or_ps(_mm_and_ps(ok, score), _mm_andnot_ps(ok, maxv));
+		minv = _mm_min_ps(minv, scores[i]);
+	}
+
+	minv = _mm_min_ps(minv, _mm_shuffle_ps(minv, minv, _MM_SHUFFLE(1, 0, 3, 2)));
+	minv = _mm_min_ps(minv, _mm_shuffle_ps(minv, minv, _MM_SHUFFLE(2, 3, 0, 1)));
+	score_min = _mm_cvtss_f32(minv);
+	if (!(score_min < QOI_CPR_MAXFLOAT)) {
+		return -1;
+	}
+
+	for (i = 0; i < 16; i++) {
+		int eq = _mm_movemask_ps(_mm_cmpeq_ps(scores[i], minv));
+		if (eq) {
+			return i * 4 + __builtin_ctz(eq);
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx2")))
+static int qoi_cpr_scan_index_avx2(const qoi_rgba_t *index, unsigned long long mask, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg) {
+	const __m256i pxv = _mm256_set1_epi32(px.v);
+	const __m256i lo8 = _mm256_set1_epi32(0xff);
+	const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256 w0 = _mm256_set1_ps(cfg->weights[0]), w1 = _mm256_set1_ps(cfg->weights[1]);
+	const __m256 w2 = _mm256_set1_ps(cfg->weights[2]), w3 = _mm256_set1_ps(cfg->weights[3]);
+	const __m256 av = _mm256_set1_ps(alpha);
+	const __m256 t0 = _mm256_set1_ps(thresh[0]), t1 = _mm256_set1_ps(thresh[1]);
+	const __m256 maxv = _mm256_set1_ps(QOI_CPR_MAXFLOAT);
+	const __m256 sign = _mm256_set1_ps(-0.f), half = _mm256_set1_ps(0.5f), quarter = _mm256_set1_ps(0.25f);
+	const __m256i pr = _mm256_set1_epi32(px.rgba.r), pg = _mm256_set1_epi32(px.rgba.g), pb = _mm256_set1_epi32(px.rgba.b);
+	const int ycocg = cfg->space == QOI_CPR_SPACE_YCOCG;
+	__m256 scores[8];
+	__m256 minv = maxv;
+	__m128 min4;
+	float score_min;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(index + i * 8));
+		__m256i ad = _mm256_or_si256(_mm256_subs_epu8(v, pxv), _mm256_subs_epu8(pxv, v));
+		__m256 dr, dg, db;
+		if (ycocg) {
+			__m256i sr = _mm256_sub_epi32(pr, _mm256_and_si256(v, lo8));
+			__m256i sg = _mm256_sub_epi32(pg, _mm256_and_si256(_mm256_srli_epi32(v, 8), lo8));
+			__m256i sb = _mm256_sub_epi32(pb, _mm256_and_si256(_mm256_srli_epi32(v, 16), lo8));
+			__m256i srb = _mm256_add_epi32(sr, sb), sg2 = _mm256_add_epi32(sg, sg);
+			__m256 y = _mm256_mul_ps(_mm256_andnot_ps(sign, _mm256_cvtepi32_ps(_mm256_add_epi32(srb, sg2))), quarter);
+			__m256 co = _mm256_andnot_ps(sign, _mm256_cvtepi32_ps(_mm256_sub_epi32(sr, sb)));
+			__m256 cg = _mm256_mul_ps(_mm256_andnot_ps(sign, _mm256_cvtepi32_ps(_mm256_sub_epi32(sg2, srb))), half);
+			dr = _mm256_mul_ps(_mm256_mul_ps(y, w0), av);
+			dg = _mm256_mul_ps(_mm256_mul_ps(co, w1), av);
+			db = _mm256_mul_ps(_mm256_mul_ps(cg, w2), av);
+		}
+		else {
+			dr = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(ad, lo8)), w0), av);
+			dg = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(ad, 8), lo8)), w1), av);
+			db = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(ad, 16), lo8)), w2), av);
+		}
+		__m256 da = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(ad, 24)), w3);
+		__m256 score = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(dr, dg), db), da);
+
+		__m256i valid = _mm256_and_si256(_mm256_set1_epi32((int)(mask >> (i * 8)) & 0xff), bits);
+		__m256 ok = _mm256_castsi256_ps(_mm256_cmpeq_epi32(valid, bits));
+		ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(dr, t0, _CMP_LE_OQ), _mm256_cmp_ps(dg, t0, _CMP_LE_OQ)));
+		ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(db, t0, _CMP_LE_OQ), _mm256_cmp_ps(da, t1, _CMP_LE_OQ)));
+
+		scores[i] = _mm256_blendv_ps(maxv, score, ok);
+		minv = _mm256_min_ps(minv, scores[i]);
+	}
+
+	min4 = _mm_min_ps(_mm256_castps256_ps128(minv), _mm256_extractf128_ps(minv, 1));
+	min4 = _mm_min_ps(min4, _mm_shuffle_ps(min4, min4, _MM_SHUFFLE(1, 0, 3, 2)));
+	min4 = _mm_min_ps(min4, _mm_shuffle_ps(min4, min4, _MM_SHUFFLE(2, 3, 0, 1)));
+	score_min = _mm_cvtss_f32(min4);
+	if (!(score_min < QOI_CPR_MAXFLOAT)) {
+		return -1;
+	}
+
+	minv = _mm256_set1_ps(score_min);
+	for (i = 0; i < 8; i++) {
+		int eq = _mm256_movemask_ps(_mm256_cmp_ps(scores[i], minv, _CMP_EQ_OQ));
+		if (eq) {
+			return i * 8 + __builtin_ctz(eq);
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int qoi_cpr_scan_index_avx512(const qoi_rgba_t *index, unsigned long long mask, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg) {
+	const __m512i pxv = _mm512_set1_epi32(px.v);
+	const __m512i lo8 = _mm512_set1_epi32(0xff);
+	const __m512 w0 = _mm512_set1_ps(cfg->weights[0]), w1 = _mm512_set1_ps(cfg->weights[1]);
+	const __m512 w2 = _mm512_set1_ps(cfg->weights[2]), w3 = _mm512_set1_ps(cfg->weights[3]);
+	const __m512 av = _mm512_set1_ps(alpha);
+	const __m512 t0 = _mm512_set1_ps(thresh[0]), t1 = _mm512_set1_ps(thresh[1]);
+	const __m512 maxv = _mm512_set1_ps(QOI_CPR_MAXFLOAT);
+	const __m512 half = _mm512_set1_ps(0.5f), quarter = _mm512_set1_ps(0.25f);
+	const __m512i pr = _mm512_set1_epi32(px.rgba.r), pg = _mm512_set1_epi32(px.rgba.g), pb = _mm512_set1_epi32(px.rgba.b);
+	const int ycocg = cfg->space == QOI_CPR_SPACE_YCOCG;
+	__m512 scores[4];
+	__m512 minv = maxv;
+	float score_min;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		__m512i v = _mm512_loadu_si512((const void *)(index + i * 16));
+		__m512i ad = _mm512_or_si512(_mm512_subs_epu8(v, pxv), _mm512_subs_epu8(pxv, v));
+		__m512 dr, dg, db;
+		if (ycocg) {
+			__m512i sr = _mm512_sub_epi32(pr, _mm512_and_si512(v, lo8));
+			__m512i sg = _mm512_sub_epi32(pg, _mm512_and_si512(_mm512_srli_epi32(v, 8), lo8));
+			__m512i sb = _mm512_sub_epi32(pb, _mm512_and_si512(_mm512_srli_epi32(v, 16), lo8));
+			__m512i srb = _mm512_add_epi32(sr, sb), sg2 = _mm512_add_epi32(sg, sg);
+			__m512 y = _mm512_mul_ps(_mm512_abs_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(srb, sg2))), quarter);
+			__m512 co = _mm512_abs_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(sr, sb)));
+			__m512 cg = _mm512_mul_ps(_mm512_abs_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(sg2, srb))), half);
+			dr = _mm512_mul_ps(_mm512_mul_ps(y, w0), av);
+			dg = _mm512_mul_ps(_mm512_mul_ps(co, w1), av);
+			db = _mm512_mul_ps(_mm512_mul_ps(cg, w2), av);
+		}
+		else {
+			dr = _mm512_mul_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_and_si512(ad, lo8)), w0), av);
+			dg = _mm512_mul_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(ad, 8), lo8)), w1), av);
+			db = _mm512_mul_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(ad, 16), lo8)), w2), av);
+		}
+		__m512 da = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(ad, 24)), w3);
+		__m512 score = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(dr, dg), db), da);
+
+		__mmask16 ok = (__mmask16)(mask >> (i * 16));
+		ok = _mm512_mask_cmp_ps_mask(ok, dr, t0, _CMP_LE_OQ);
+		ok = _mm512_mask_cmp_ps_mask(ok, dg, t0, _CMP_LE_OQ);
+		ok = _mm512_mask_cmp_ps_mask(ok, db, t0, _CMP_LE_OQ);
+		ok = _mm512_mask_cmp_ps_mask(ok, da, t1, _CMP_LE_OQ);
+
+		scores[i] = _mm512_mask_blend_ps(ok, maxv, score);
+		minv = _mm512_min_ps(minv, scores[i]);
+	}
+
+	score_min = _mm512_reduce_min_ps(minv);
+	if (!(score_min < QOI_CPR_MAXFLOAT)) {
+		return -1;
+	}
+
+	minv = _mm512_set1_ps(score_min);
+	for (i = 0; i < 4; i++) {
+		__mmask16 eq = _mm512_cmp_ps_mask(scores[i], minv, _CMP_EQ_OQ);
+		if (eq) {
+			return i * 16 + __builtin_ctz(eq);
+		}
+	}
+	return -1;
+}
+#endif /* QOI_X86_DISPATCH */
+
+/* Returns the fastest SIMD scan for this CPU, or NULL to use the inlined
+scalar qoi_cpr_scan_index */
+static qoi_cpr_scan_fn qoi_cpr_scan_select(void) {
+	#ifdef QOI_X86_DISPATCH
+		switch (qoi_isa()) {
+			case QOI_ISA_AVX512: return qoi_cpr_scan_index_avx512;
+			case QOI_ISA_AVX2: return qoi_cpr_scan_index_avx2;
+			case QOI_ISA_SSE42:
+			case QOI_ISA_SSE2: return qoi_cpr_scan_index_sse2;
+		}
+	#endif
+	return NULL;
+}
+
+static inline int qoi_cpr_ctz(unsigned long long v) {
+	int n = 0;
+	for (; !(v & 1); n++) {
+		v >>= 1;
+	}
+	return n;
+}
+
+static inline int qoi_cpr_popcount(unsigned long long v) {
+	int n = 0;
+	for (; v; n++) {
+		v &= v - 1;
+	}
+	return n;
+}
+
+/* Encode px relative to *px_stored with the smallest of DIFF, LUMA, RGB or
+RGBA that stays within tolerance and update *px_stored to the decoded color.
+Returns the number of bytes written, which also identifies the op */
+static QOI_FORCE_INLINE int qoi_cpr_encode_delta(unsigned char *bytes, qoi_rgba_t *px_stored, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	qoi_rgba_t stored = *px_stored;
+
+	if (abs(px.rgba.a - stored.rgba.a) * cfg->weights[3] <= thresh[1]) {
+		signed char vr = px.rgba.r - stored.rgba.r;
+		signed char vg = px.rgba.g - stored.rgba.g;
+		signed char vb = px.rgba.b - stored.rgba.b;
+
+		signed char _vr = QOI_CPR_CLAMP(vr, -2, 1);
+		signed char _vg = QOI_CPR_CLAMP(vg, -2, 1);
+		signed char _vb = QOI_CPR_CLAMP(vb, -2, 1);
+
+		qoi_rgba_t px_potential = {
+			.rgba.r = stored.rgba.r + _vr,
+			.rgba.g = stored.rgba.g + _vg,
+			.rgba.b = stored.rgba.b + _vb,
+			.rgba.a = stored.rgba.a
+		};
+
+		if (
+			px.v == px_potential.v ||
+			(QOI_STATS_ADD(cpr_compares, 1), compare_color(px, alpha, px_potential, thresh, cfg, NULL))
+		) {
+			bytes[0] = QOI_OP_DIFF | (_vr + 2) << 4 | (_vg + 2) << 2 | (_vb + 2);
+			*px_stored = px_potential;
+			return 1;
+		}
+
+		_vg = QOI_CPR_CLAMP(vg, -32, 31);
+		signed char vg_r = vr - _vg;
+		signed char vg_b = vb - _vg;
+		vg_r = QOI_CPR_CLAMP(vg_r, -8, 7);
+		vg_b = QOI_CPR_CLAMP(vg_b, -8, 7);
+
+		stored.rgba.r += _vg + vg_r;
+		stored.rgba.g += _vg;
+		stored.rgba.b += _vg + vg_b;
+
+		if (
+			px.v == stored.v ||
+			(QOI_STATS_ADD(cpr_compares, 1), compare_color(px, alpha, stored, thresh, cfg, NULL))
+		) {
+			bytes[0] = QOI_OP_LUMA     | (_vg  + 32);
+			bytes[1] = (vg_r + 8) << 4 | (vg_b +  8);
+			*px_stored = stored;
+			return 2;
+		}
+
+		bytes[0] = QOI_OP_RGB;
+		*(qoi_rgba_t *)(bytes + 1) = px;
+		*px_stored = px;
+		px_stored->rgba.a = px_potential.rgba.a;
+		return 4;
+	}
+
+	bytes[0] = QOI_OP_RGBA;
+	*(qoi_rgba_t *)(bytes + 1) = px;
+	*px_stored = px;
+	return 5;
+}
+
+#define QOI_CPR_RECENT 4
+
+/* QOI_CPR_EFFORT_FAST: only consider the hash slot of px and the slots used
+most recently */
+static QOI_FORCE_INLINE int qoi_cpr_scan_recent(const qoi_rgba_t *index, unsigned long long mask, const int *recent, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	float score_min = QOI_CPR_MAXFLOAT;
+	float score;
+	int i, index_pos = -1;
+
+	for (i = -1; i < QOI_CPR_RECENT; i++) {
+		int slot = i < 0 ? (int)(QOI_COLOR_HASH(px) % 64) : recent[i];
+		if (
+			(mask & ((unsigned long long)1 << slot)) &&
+			(QOI_STATS_ADD(cpr_compares, 1), compare_color(px, alpha, index[slot], thresh, cfg, &score)) &&
+			score < score_min
+		) {
+			score_min = score;
+			index_pos = slot;
+		}
+	}
+
+	return index_pos;
+}
+
+static QOI_FORCE_INLINE void qoi_cpr_touch_recent(int *recent, int slot) {
+	int i;
+	for (i = 0; i < QOI_CPR_RECENT - 1 && recent[i] != slot; i++);
+	for (; i > 0; i--) {
+		recent[i] = recent[i - 1];
+	}
+	recent[0] = slot;
+}
+
+/* QOI_CPR_EFFORT_LOOKAHEAD: like qoi_cpr_scan_index, but prefer the closest
+entry that is also within tolerance of the next pixel, so that pixel can
+continue as a run */
+static QOI_FORCE_INLINE int qoi_cpr_scan_index_lookahead(const qoi_rgba_t *index, unsigned long long mask, const qoi_rgba_t px, const float alpha, const qoi_rgba_t px_next, const float alpha_next, const float *thresh, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	float score_min = QOI_CPR_MAXFLOAT, score_next_min = QOI_CPR_MAXFLOAT;
+	float score;
+	int i, index_pos = -1, index_next_pos = -1;
+
+	for (i = 0; i < 64; i++) {
+		if (
+			(mask & ((unsigned long long)1 << i)) &&
+			(QOI_STATS_ADD(cpr_compares, 1), compare_color(px, alpha, index[i], thresh, cfg, &score))
+		) {
+			if (score < score_min) {
+				score_min = score;
+				index_pos = i;
+			}
+			if (
+				score < score_next_min &&
+				(QOI_STATS_ADD(cpr_compares, 1), compare_color(px_next, alpha_next, index[i], thresh, cfg, NULL))
+			) {
+				score_next_min = score;
+				index_next_pos = i;
+			}
+		}
+	}
+
+	return index_next_pos >= 0 ? index_next_pos : index_pos;
+}
+
+/* QOI_CPR_EFFORT_TRELLIS: pixels are collected into windows. Each window is
+split into segments by dynamic programming, so that the total number of bytes
+is minimal. A segment is a single color within tolerance of all its pixels,
+emitted as one op (or nothing, if it continues the previous color) followed by
+a run. The segment color is picked from the intersection of the pixels'
+tolerance boxes: the index entry or the color closest to the previous one.
+Every emitted color is verified with compare_color; if that fails, the segment
+is encoded pixel by pixel as usual. */
+
+#define QOI_CPR_TRELLIS_WINDOW 32
 
+typedef struct {
+	qoi_rgba_t px[QOI_CPR_TRELLIS_WINDOW];
+	float alpha[QOI_CPR_TRELLIS_WINDOW];
+	float thresh[QOI_CPR_TRELLIS_WINDOW][2];
+	int len;
+} qoi_cpr_window_t;
+
+static QOI_FORCE_INLINE int qoi_cpr_flush_run(unsigned char *bytes, int p, int *run QOI_STATS_PARAM) {
+	if (*run > 0) {
+		bytes[p++] = QOI_OP_RUN | (*run - 1);
+		QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
+		*run = 0;
+	}
+	return p;
+}
+
+/* Encode exactly px from px_stored, like the lossless encoder without the index */
+static int qoi_cpr_encode_exact(unsigned char *bytes, const qoi_rgba_t px_stored, const qoi_rgba_t px) {
+	if (px.rgba.a == px_stored.rgba.a) {
+		signed char vr = px.rgba.r - px_stored.rgba.r;
+		signed char vg = px.rgba.g - px_stored.rgba.g;
+		signed char vb = px.rgba.b - px_stored.rgba.b;
+		signed char vg_r = vr - vg;
+		signed char vg_b = vb - vg;
+
+		if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+			bytes[0] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+			return 1;
+		}
+		if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+			bytes[0] = QOI_OP_LUMA     | (vg   + 32);
+			bytes[1] = (vg_r + 8) << 4 | (vg_b +  8);
+			return 2;
+		}
+		bytes[0] = QOI_OP_RGB;
+		bytes[1] = px.rgba.r;
+		bytes[2] = px.rgba.g;
+		bytes[3] = px.rgba.b;
+		return 4;
+	}
+	bytes[0] = QOI_OP_RGBA;
+	bytes[1] = px.rgba.r;
+	bytes[2] = px.rgba.g;
+	bytes[3] = px.rgba.b;
+	bytes[4] = px.rgba.a;
+	return 5;
+}
+
+/* Per channel range of values that compare_color accepts for px. Rounding
+may differ slightly from compare_color, so results are verified later. */
+static void qoi_cpr_tolerance_box(const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_cpr_cfg *cfg, int *lo, int *hi) {
+	int v[4] = {px.rgba.r, px.rgba.g, px.rgba.b, px.rgba.a};
+	int c;
+
+	/* In YCoCg, +-h on every channel changes Y by up to h and Co, Cg by up
+	to 2h, so use one box that keeps all three within tolerance */
+	float w_ycocg = QOI_CPR_MAX(cfg->weights[0], 2 * QOI_CPR_MAX(cfg->weights[1], cfg->weights[2])) * alpha;
+
+	for (c = 0; c < 4; c++) {
+		float w = c == 3 ? cfg->weights[3] : cfg->space == QOI_CPR_SPACE_YCOCG ? w_ycocg : cfg->weights[c] * alpha;
+		float t = thresh[c < 3 ? 0 : 1];
+		int h = w > 0 ? (t >= w * 255 ? 255 : (int)(t / w)) : 255;
+		if (t < 0) {
+			h = -1;
+		}
+		lo[c] = QOI_CPR_MAX(v[c] - h, 0);
+		hi[c] = QOI_CPR_MIN(v[c] + h, 255);
+	}
+}
+
+/* Find the cheapest color in the box [lo, hi] relative to px_stored and,
+among those, the one closest to target. Returns the size of the op in bytes,
+0 if px_stored itself is in the box. */
+static int qoi_cpr_box_color(const qoi_rgba_t px_stored, const int *lo, const int *hi, const int *target, qoi_rgba_t *color) {
+	int r = px_stored.rgba.r, g = px_stored.rgba.g, b = px_stored.rgba.b, a = px_stored.rgba.a;
+	int rlo = lo[0] - r, rhi = hi[0] - r;
+	int glo = lo[1] - g, ghi = hi[1] - g;
+	int blo = lo[2] - b, bhi = hi[2] - b;
+	int dg_lo, dg_hi, dr, dg, db;
+
+	color->rgba.r = QOI_CPR_CLAMP(target[0], lo[0], hi[0]);
+	color->rgba.g = QOI_CPR_CLAMP(target[1], lo[1], hi[1]);
+	color->rgba.b = QOI_CPR_CLAMP(target[2], lo[2], hi[2]);
+	color->rgba.a = a;
+
+	if (a < lo[3] || a > hi[3]) {
+		color->rgba.a = QOI_CPR_CLAMP(target[3], lo[3], hi[3]);
+		return 5;
+	}
+	if (rlo <= 0 && rhi >= 0 && glo <= 0 && ghi >= 0 && blo <= 0 && bhi >= 0) {
+		*color = px_stored;
+		return 0;
+	}
 	if (
-		data == NULL || out_len == NULL || desc == NULL ||
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		desc->height >= QOI_PIXELS_MAX / desc->width
+		QOI_CPR_MAX(rlo, -2) <= QOI_CPR_MIN(rhi, 1) &&
+		QOI_CPR_MAX(glo, -2) <= QOI_CPR_MIN(ghi, 1) &&
+		QOI_CPR_MAX(blo, -2) <= QOI_CPR_MIN(bhi, 1)
 	) {
-		return NULL;
+		color->rgba.r = r + QOI_CPR_CLAMP(target[0] - r, QOI_CPR_MAX(rlo, -2), QOI_CPR_MIN(rhi, 1));
+		color->rgba.g = g + QOI_CPR_CLAMP(target[1] - g, QOI_CPR_MAX(glo, -2), QOI_CPR_MIN(ghi, 1));
+		color->rgba.b = b + QOI_CPR_CLAMP(target[2] - b, QOI_CPR_MAX(blo, -2), QOI_CPR_MIN(bhi, 1));
+		return 1;
 	}
 
-	max_size =
-		desc->width * desc->height * (desc->channels + 1) +
-		QOI_HEADER_SIZE + sizeof(qoi_padding);
+	/* LUMA: vg within the box and -32..31, vr - vg and vb - vg within -8..7 */
+	dg_lo = QOI_CPR_MAX(QOI_CPR_MAX(glo, -32), QOI_CPR_MAX(rlo - 7, blo - 7));
+	dg_hi = QOI_CPR_MIN(QOI_CPR_MIN(ghi, 31), QOI_CPR_MIN(rhi + 8, bhi + 8));
+	if (dg_lo <= dg_hi) {
+		dg = QOI_CPR_CLAMP(target[1] - g, dg_lo, dg_hi);
+		dr = QOI_CPR_CLAMP(target[0] - r, QOI_CPR_MAX(rlo, dg - 8), QOI_CPR_MIN(rhi, dg + 7));
+		db = QOI_CPR_CLAMP(target[2] - b, QOI_CPR_MAX(blo, dg - 8), QOI_CPR_MIN(bhi, dg + 7));
+		color->rgba.r = r + dr;
+		color->rgba.g = g + dg;
+		color->rgba.b = b + db;
+		return 2;
+	}
+	return 4;
+}
 
-	p = 0;
-	bytes = (unsigned char *) QOI_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
+static int qoi_cpr_window_covers(const qoi_cpr_window_t *win, int from, int to, const qoi_rgba_t color, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	int k;
+	for (k = from; k < to; k++) {
+		if (
+			win->px[k].v != color.v &&
+			(QOI_STATS_ADD(cpr_compares, 1), !compare_color(win->px[k], win->alpha[k], color, win->thresh[k], cfg, NULL))
+		) {
+			return 0;
+		}
 	}
+	return 1;
+}
 
-	qoi_write_32(bytes, &p, QOI_MAGIC);
-	qoi_write_32(bytes, &p, desc->width);
-	qoi_write_32(bytes, &p, desc->height);
-	bytes[p++] = desc->channels;
-	bytes[p++] = desc->colorspace;
+static int qoi_cpr_encode_window(unsigned char *bytes, int p, const qoi_cpr_window_t *win, int last, qoi_rgba_t *index, unsigned long long *mask, qoi_rgba_t *px_stored, int *run, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	int n = win->len;
+	int lo[QOI_CPR_TRELLIS_WINDOW][4], hi[QOI_CPR_TRELLIS_WINDOW][4];
+	unsigned long long tol[QOI_CPR_TRELLIS_WINDOW];
+	float score[QOI_CPR_TRELLIS_WINDOW][64];
+	int cost[QOI_CPR_TRELLIS_WINDOW + 1], from[QOI_CPR_TRELLIS_WINDOW + 1], slot[QOI_CPR_TRELLIS_WINDOW + 1];
+	qoi_rgba_t color[QOI_CPR_TRELLIS_WINDOW + 1];
+	int seg[QOI_CPR_TRELLIS_WINDOW + 1], segs;
+	int i, j, k, c;
+
+	/* Tolerance box and in-tolerance index entries of each pixel */
+	for (k = 0; k < n; k++) {
+		qoi_cpr_tolerance_box(win->px[k], win->alpha[k], win->thresh[k], cfg, lo[k], hi[k]);
+		tol[k] = 0;
+		for (i = 0; i < 64; i++) {
+			if (
+				(*mask & ((unsigned long long)1 << i)) &&
+				(QOI_STATS_ADD(cpr_compares, 1), compare_color(win->px[k], win->alpha[k], index[i], win->thresh[k], cfg, &score[k][i]))
+			) {
+				tol[k] |= (unsigned long long)1 << i;
+			}
+		}
+	}
 
+	cost[0] = 0;
+	color[0] = *px_stored;
+	for (j = 1; j <= n; j++) {
+		cost[j] = 0x7fffffff;
+	}
 
-	pixels = (const unsigned char *)data;
+	for (i = 0; i < n; i++) {
+		int box_lo[4] = {0, 0, 0, 0}, box_hi[4] = {255, 255, 255, 255};
+		int sum[4] = {0, 0, 0, 0};
+		unsigned long long seg_tol = ~(unsigned long long)0;
+
+		for (j = i + 1; j <= n; j++) {
+			qoi_rgba_t col;
+			int op, s = -1, bytes_len, empty = 0;
+
+			sum[0] += win->px[j - 1].rgba.r;
+			sum[1] += win->px[j - 1].rgba.g;
+			sum[2] += win->px[j - 1].rgba.b;
+			sum[3] += win->px[j - 1].rgba.a;
+			for (c = 0; c < 4; c++) {
+				box_lo[c] = QOI_CPR_MAX(box_lo[c], lo[j - 1][c]);
+				box_hi[c] = QOI_CPR_MIN(box_hi[c], hi[j - 1][c]);
+				empty |= box_lo[c] > box_hi[c];
+			}
+			seg_tol &= tol[j - 1];
+
+			if (empty && !seg_tol) {
+				if (j == i + 1) {
+					/* Not even the pixel itself is within tolerance */
+					col = win->px[i];
+					op = col.v == color[i].v ? 0 : 5;
+				}
+				else {
+					break;
+				}
+			}
+			else if (empty) {
+				op = 5; /* only reachable through the index */
+				col = win->px[i];
+			}
+			else {
+				int len = j - i;
+				int mean[4] = {
+					(sum[0] + len / 2) / len, (sum[1] + len / 2) / len,
+					(sum[2] + len / 2) / len, (sum[3] + len / 2) / len
+				};
+				op = qoi_cpr_box_color(color[i], box_lo, box_hi, mean, &col);
+			}
+
+			if (op > 1 && seg_tol) {
+				/* The entry closest to the first pixel of the segment */
+				unsigned long long bits = seg_tol;
+				float score_min = QOI_CPR_MAXFLOAT;
+				for (; bits; bits &= bits - 1) {
+					int e = qoi_cpr_ctz(bits);
+					if (score[i][e] < score_min) {
+						score_min = score[i][e];
+						s = e;
+					}
+				}
+				col = index[s];
+				op = 1;
+			}
+			else if (op > 1) {
+				/* Colors emitted earlier in this window are in the index too */
+				int m, depth;
+				for (m = i, depth = 0; m > 0 && depth < 8; m = from[m], depth++) {
+					qoi_rgba_t q = color[m];
+					if (
+						q.rgba.r >= box_lo[0] && q.rgba.r <= box_hi[0] &&
+						q.rgba.g >= box_lo[1] && q.rgba.g <= box_hi[1] &&
+						q.rgba.b >= box_lo[2] && q.rgba.b <= box_hi[2] &&
+						q.rgba.a >= box_lo[3] && q.rgba.a <= box_hi[3]
+					) {
+						s = QOI_COLOR_HASH(q) % 64;
+						col = q;
+						op = 1;
+						break;
+					}
+				}
+			}
+
+			/* The op for the first pixel (none if the color continues), then a
+			run for the rest */
+			bytes_len = op + (j - i - (op ? 1 : 0) + 61) / 62;
+			if (cost[i] + bytes_len < cost[j]) {
+				cost[j] = cost[i] + bytes_len;
+				from[j] = i;
+				color[j] = col;
+				slot[j] = s;
+			}
+		}
+	}
+
+	/* Walk back to collect the segment boundaries */
+	segs = 0;
+	for (j = n; j > 0; j = from[j]) {
+		seg[segs++] = j;
+	}
+
+	for (k = 0; segs > 0; segs--) {
+		int end = seg[segs - 1];
+		qoi_rgba_t col = color[end];
+		int s = slot[end];
+
+		if (col.v == px_stored->v && qoi_cpr_window_covers(win, k, end, col, cfg QOI_STATS_ARG)) {
+			/* Continue the previous color */
+		}
+		else if (s >= 0 && index[s].v == col.v && qoi_cpr_window_covers(win, k, end, col, cfg QOI_STATS_ARG)) {
+			p = qoi_cpr_flush_run(bytes, p, run QOI_STATS_ARG);
+			bytes[p++] = QOI_OP_INDEX | s;
+			QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+			QOI_STATS_ADD(cpr_scan_hits, 1);
+			*px_stored = col;
+			k++;
+		}
+		else if (col.v != px_stored->v && qoi_cpr_window_covers(win, k, end, col, cfg QOI_STATS_ARG)) {
+			int index_pos = QOI_COLOR_HASH(col) % 64;
+
+			p = qoi_cpr_flush_run(bytes, p, run QOI_STATS_ARG);
+			QOI_STATS_ADD(index_lookups, 1);
+			if (index[index_pos].v == col.v) {
+				bytes[p++] = QOI_OP_INDEX | index_pos;
+				QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+				QOI_STATS_ADD(index_hits, 1);
+			}
+			else {
+				int len = qoi_cpr_encode_exact(bytes + p, *px_stored, col);
+				QOI_STATS_ADD(cpr_scan_misses, 1);
+				p += len;
+				QOI_STATS_OP(
+					len == 1 ? QOI_STATS_OP_DIFF :
+					len == 2 ? QOI_STATS_OP_LUMA :
+					len == 4 ? QOI_STATS_OP_RGB : QOI_STATS_OP_RGBA,
+					len
+				);
+				index[index_pos] = col;
+				*mask |= (unsigned long long)1 << index_pos;
+			}
+			*px_stored = col;
+			k++;
+		}
+		else {
+			/* The planned color doesn't hold up, encode the segment pixel by
+			pixel against the previous color */
+			for (; k < end; k++) {
+				qoi_rgba_t px = win->px[k];
+				if (
+					px.v == px_stored->v ||
+					(QOI_STATS_ADD(cpr_compares, 1), compare_color(px, win->alpha[k], *px_stored, win->thresh[k], cfg, NULL))
+				) {
+					if (++*run == 62) {
+						p = qoi_cpr_flush_run(bytes, p, run QOI_STATS_ARG);
+					}
+				}
+				else {
+					int len, index_pos;
+
+					p = qoi_cpr_flush_run(bytes, p, run QOI_STATS_ARG);
+					QOI_STATS_ADD(cpr_scan_misses, 1);
+					len = qoi_cpr_encode_delta(bytes + p, px_stored, px, win->alpha[k], win->thresh[k], cfg QOI_STATS_ARG);
+					p += len;
+					QOI_STATS_OP(
+						len == 1 ? QOI_STATS_OP_DIFF :
+						len == 2 ? QOI_STATS_OP_LUMA :
+						len == 4 ? QOI_STATS_OP_RGB : QOI_STATS_OP_RGBA,
+						len
+					);
+					index_pos = QOI_COLOR_HASH((*px_stored)) % 64;
+					index[index_pos] = *px_stored;
+					*mask |= (unsigned long long)1 << index_pos;
+				}
+			}
+		}
+
+		for (; k < end; k++) {
+			if (++*run == 62) {
+				p = qoi_cpr_flush_run(bytes, p, run QOI_STATS_ARG);
+			}
+		}
+	}
+
+	if (last) {
+		p = qoi_cpr_flush_run(bytes, p, run QOI_STATS_ARG);
+	}
+	return p;
+}
 
+/* Index slot protection: number of hits since it was stored that make an
+index entry worth keeping */
+#define QOI_CPR_HOT 4
+
+/* *px_delta (n bytes from px_stored) would overwrite a hot index entry. Look
+for the closest color within one step per channel that still covers px at no
+extra size and hashes to a free or less used slot. Returns the new size or 0
+if there is none */
+static int qoi_cpr_protect_slot(unsigned char *bytes, const qoi_rgba_t px_stored, qoi_rgba_t *px_delta, const int n, const qoi_rgba_t px, const float alpha, const float *thresh, const qoi_rgba_t *index, unsigned long long mask, const unsigned char *usage, const qoi_cpr_cfg *cfg QOI_STATS_PARAM) {
+	int slot = QOI_COLOR_HASH((*px_delta)) % 64;
+	qoi_rgba_t center = *px_delta;
+	float score, score_min = QOI_CPR_MAXFLOAT;
+	int dr, dg, db, n_min = 0;
+
+	if (!(mask & ((unsigned long long)1 << slot)) || usage[slot] < QOI_CPR_HOT || index[slot].v == center.v) {
+		return 0;
+	}
+
+	for (dr = -1; dr <= 1; dr++) {
+		for (dg = -1; dg <= 1; dg++) {
+			for (db = -1; db <= 1; db++) {
+				qoi_rgba_t cand = center;
+				int r = cand.rgba.r + dr, g = cand.rgba.g + dg, b = cand.rgba.b + db;
+				int cand_slot, len;
+				unsigned char tmp[5];
+
+				if ((r | g | b) & ~255) {
+					continue;
+				}
+				cand.rgba.r = r;
+				cand.rgba.g = g;
+				cand.rgba.b = b;
+				cand_slot = QOI_COLOR_HASH(cand) % 64;
+				if ((mask & ((unsigned long long)1 << cand_slot)) && usage[cand_slot] >= usage[slot]) {
+					continue;
+				}
+
+				QOI_STATS_ADD(cpr_compares, 1);
+				if (!compare_color(px, alpha, cand, thresh, cfg, &score) || score >= score_min) {
+					continue;
+				}
+				len = qoi_cpr_encode_exact(tmp, px_stored, cand);
+				if (len > n) {
+					continue;
+				}
+
+				memcpy(bytes, tmp, len);
+				score_min = score;
+				n_min = len;
+				*px_delta = cand;
+			}
+		}
+	}
+	return n_min;
+}
+
+/* a / 255.f for every alpha, so the per pixel alpha weight is a lookup. The
+entries are constant folded from the same division, so they are exact */
+#define QOI_CPR_ALPHA4(a) (a) / 255.f, (a + 1) / 255.f, (a + 2) / 255.f, (a + 3) / 255.f
+#define QOI_CPR_ALPHA16(a) QOI_CPR_ALPHA4(a), QOI_CPR_ALPHA4(a + 4), QOI_CPR_ALPHA4(a + 8), QOI_CPR_ALPHA4(a + 12)
+#define QOI_CPR_ALPHA64(a) QOI_CPR_ALPHA16(a), QOI_CPR_ALPHA16(a + 16), QOI_CPR_ALPHA16(a + 32), QOI_CPR_ALPHA16(a + 48)
+
+static const float qoi_cpr_alpha[256] = {
+	QOI_CPR_ALPHA64(0), QOI_CPR_ALPHA64(64), QOI_CPR_ALPHA64(128), QOI_CPR_ALPHA64(192)
+};
+
+static QOI_FORCE_INLINE qoi_rgba_t qoi_cpr_load(const unsigned char *pixels, const int channels, const int mulalpha) {
+	qoi_rgba_t px;
+	px.rgba.r = pixels[0];
+	px.rgba.g = pixels[1];
+	px.rgba.b = pixels[2];
+	px.rgba.a = channels == 4 ? pixels[3] : 255;
+	if (mulalpha) {
+		px.v = px.rgba.a ? px.v : 0;
+	}
+	return px;
+}
+
+/* -----------------------------------------------------------------------------
+Analysis stage: the local_thresh pairs of a whole row are computed before the
+row is emitted, from data parallel difference passes over the row */
+
+/* Weighted color and alpha differences of count pixel pairs a[j], b[j]. With
+mul_a/mul_b set, pixels with zero alpha count as {0, 0, 0, 0} */
+static QOI_FORCE_INLINE void qoi_cpr_diff_pixels(float *diff_c, float *diff_a, const unsigned char *a, const unsigned char *b, int count, const qoi_cpr_cfg *cfg, const int channels, const int mul_a, const int mul_b) {
+	int j;
+	for (j = 0; j < count; j++) {
+		qoi_rgba_t pa = qoi_cpr_load(a + j * channels, channels, mul_a);
+		qoi_rgba_t pb = qoi_cpr_load(b + j * channels, channels, mul_b);
+		if (cfg->space == QOI_CPR_SPACE_YCOCG) {
+			int dr = pa.rgba.r - pb.rgba.r;
+			int dg = pa.rgba.g - pb.rgba.g;
+			int db = pa.rgba.b - pb.rgba.b;
+			float y, co, cg;
+			QOI_CPR_YCOCG(dr, dg, db, y, co, cg);
+			diff_c[j] = y * cfg->weights[0]
+				+ co * cfg->weights[1]
+				+ cg * cfg->weights[2];
+		}
+		else {
+			diff_c[j] = abs(pa.rgba.r - pb.rgba.r) * cfg->weights[0]
+				+ abs(pa.rgba.g - pb.rgba.g) * cfg->weights[1]
+				+ abs(pa.rgba.b - pb.rgba.b) * cfg->weights[2];
+		}
+		diff_a[j] = abs(pa.rgba.a - pb.rgba.a);
+	}
+}
+
+/* SIMD variants of qoi_cpr_diff_pixels, with the same float operations in the
+same order. They leave the tail and the cases they don't handle (YCoCg) to the
+scalar loop */
+typedef void (*qoi_cpr_diff_fn)(float *diff_c, float *diff_a, const unsigned char *a, const unsigned char *b, int count, const qoi_cpr_cfg *cfg, int channels, int mul_a, int mul_b);
+
+#ifdef QOI_X86_DISPATCH
+__attribute__((target("sse2")))
+static void qoi_cpr_diff_pixels_sse2(float *diff_c, float *diff_a, const unsigned char *a, const unsigned char *b, int count, const qoi_cpr_cfg *cfg, int channels, int mul_a, int mul_b) {
+	const __m128i lo8 = _mm_set1_epi32(0xff);
+	const __m128i amask = _mm_set1_epi32((int)0xff000000);
+	const __m128 w0 = _mm_set1_ps(cfg->weights[0]);
+	const __m128 w1 = _mm_set1_ps(cfg->weights[1]);
+	const __m128 w2 = _mm_set1_ps(cfg->weights[2]);
+	int j = 0;
+
+	if (channels == 4 && cfg->space == QOI_CPR_SPACE_RGB) {
+		for (; j + 4 <= count; j += 4) {
+			__m128i va = _mm_loadu_si128((const __m128i *)(a + j * 4));
+			__m128i vb = _mm_loadu_si128((const __m128i *)(b + j * 4));
+			if (mul_a) {
+				va = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(va, amask), _mm_setzero_si128()), va);
+			}
+			if (mul_b) {
+				vb = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(vb, amask), _mm_setzero_si128()), vb);
+			}
+			__m128i ad = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+			__m128 dr = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(ad, lo8)), w0);
+			__m128 dg = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(ad, 8), lo8)), w1);
+			__m128 db = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(ad, 16), lo8)), w2);
+			_mm_storeu_ps(diff_c + j, _mm_add_ps(_mm_add_ps(dr, dg), db));
+			_mm_storeu_ps(diff_a + j, _mm_cvtepi32_ps(_mm_srli_epi32(ad, 24)));
+		}
+	}
+	qoi_cpr_diff_pixels(diff_c + j, diff_a + j, a + j * channels, b + j * channels, count - j, cfg, channels, mul_a, mul_b);
+}
+
+/* Loads 8 pixels as 8 x 32 bits. RGB pixels are spread out with a byte
+shuffle and get alpha 0 on both sides, so the alpha difference stays 0 */
+__attribute__((target("avx2")))
+static inline __m256i qoi_cpr_load8_avx2(const unsigned char *p, int channels, int mul) {
+	__m256i v;
+	if (channels == 4) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		if (mul) {
+			__m256i zero = _mm256_cmpeq_epi32(_mm256_and_si256(v, _mm256_set1_epi32((int)0xff000000)), _mm256_setzero_si256());
+			v = _mm256_andnot_si256(zero, v);
+		}
+	}
+	else {
+		const __m256i spread = _mm256_setr_epi8(
+			0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128,
+			0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128
+		);
+		v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+			_mm_loadu_si128((const __m128i *)(p + 12)), 1
+		);
+		v = _mm256_shuffle_epi8(v, spread);
+	}
+	return v;
+}
+
+__attribute__((target("avx2")))
+static void qoi_cpr_diff_pixels_avx2(float *diff_c, float *diff_a, const unsigned char *a, const unsigned char *b, int count, const qoi_cpr_cfg *cfg, int channels, int mul_a, int mul_b) {
+	const __m256i lo8 = _mm256_set1_epi32(0xff);
+	const __m256 w0 = _mm256_set1_ps(cfg->weights[0]);
+	const __m256 w1 = _mm256_set1_ps(cfg->weights[1]);
+	const __m256 w2 = _mm256_set1_ps(cfg->weights[2]);
+	/* The RGB loads read 4 bytes past the 8th pixel */
+	int j = 0, lookahead = channels == 4 ? 8 : 10;
+
+	if (cfg->space != QOI_CPR_SPACE_RGB) {
+		lookahead = count + 1;
+	}
+	for (; j + lookahead <= count; j += 8) {
+		__m256i va = qoi_cpr_load8_avx2(a + j * channels, channels, mul_a);
+		__m256i vb = qoi_cpr_load8_avx2(b + j * channels, channels, mul_b);
+		__m256i ad = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+		__m256 dr = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(ad, lo8)), w0);
+		__m256 dg = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(ad, 8), lo8)), w1);
+		__m256 db = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(ad, 16), lo8)), w2);
+		_mm256_storeu_ps(diff_c + j, _mm256_add_ps(_mm256_add_ps(dr, dg), db));
+		_mm256_storeu_ps(diff_a + j, _mm256_cvtepi32_ps(_mm256_srli_epi32(ad, 24)));
+	}
+	qoi_cpr_diff_pixels(diff_c + j, diff_a + j, a + j * channels, b + j * channels, count - j, cfg, channels, mul_a, mul_b);
+}
+#endif /* QOI_X86_DISPATCH */
+
+/* Returns the fastest difference pass for this CPU, or NULL to use the
+inlined scalar qoi_cpr_diff_pixels. AVX-512 adds nothing over AVX2 here */
+static qoi_cpr_diff_fn qoi_cpr_diff_select(void) {
+	#ifdef QOI_X86_DISPATCH
+		switch (qoi_isa()) {
+			case QOI_ISA_AVX512:
+			case QOI_ISA_AVX2: return qoi_cpr_diff_pixels_avx2;
+			case QOI_ISA_SSE42:
+			case QOI_ISA_SSE2: return qoi_cpr_diff_pixels_sse2;
+		}
+	#endif
+	return NULL;
+}
+
+/* same[j] = 1 if pixel j of row equals pixel j + 1 as the encoder loads them,
+for j < count. With mulalpha all pixels with zero alpha are equal, so the
+transparent parts of sprites become flat spans whatever their color */
+static QOI_FORCE_INLINE void qoi_cpr_same_pixels(int *same, const unsigned char *row, int count, const int channels, const int mulalpha) {
+	int j;
+	for (j = 0; j < count; j++) {
+		same[j] = qoi_cpr_load(row + j * channels, channels, mulalpha).v == qoi_cpr_load(row + (j + 1) * channels, channels, mulalpha).v;
+	}
+}
+
+typedef void (*qoi_cpr_same_fn)(int *same, const unsigned char *row, int count, int channels, int mulalpha);
+
+#ifdef QOI_X86_DISPATCH
+__attribute__((target("sse2")))
+static void qoi_cpr_same_pixels_sse2(int *same, const unsigned char *row, int count, int channels, int mulalpha) {
+	const __m128i amask = _mm_set1_epi32((int)0xff000000);
+	const __m128i one = _mm_set1_epi32(1);
+	int j = 0;
+
+	if (channels == 4) {
+		for (; j + 4 <= count; j += 4) {
+			__m128i va = _mm_loadu_si128((const __m128i *)(row + j * 4));
+			__m128i vb = _mm_loadu_si128((const __m128i *)(row + j * 4 + 4));
+			if (mulalpha) {
+				va = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(va, amask), _mm_setzero_si128()), va);
+				vb = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(vb, amask), _mm_setzero_si128()), vb);
+			}
+			_mm_storeu_si128((__m128i *)(same + j), _mm_and_si128(_mm_cmpeq_epi32(va, vb), one));
+		}
+	}
+	qoi_cpr_same_pixels(same + j, row + j * channels, count - j, channels, mulalpha);
+}
+
+__attribute__((target("avx2")))
+static void qoi_cpr_same_pixels_avx2(int *same, const unsigned char *row, int count, int channels, int mulalpha) {
+	const __m256i one = _mm256_set1_epi32(1);
+	/* The second RGB load reads 4 bytes past the 9th pixel */
+	int j = 0, lookahead = channels == 4 ? 8 : 10;
+
+	for (; j + lookahead <= count; j += 8) {
+		__m256i va = qoi_cpr_load8_avx2(row + j * channels, channels, mulalpha);
+		__m256i vb = qoi_cpr_load8_avx2(row + (j + 1) * channels, channels, mulalpha);
+		_mm256_storeu_si256((__m256i *)(same + j), _mm256_and_si256(_mm256_cmpeq_epi32(va, vb), one));
+	}
+	qoi_cpr_same_pixels(same + j, row + j * channels, count - j, channels, mulalpha);
+}
+#endif /* QOI_X86_DISPATCH */
+
+/* Returns the fastest qoi_cpr_same_pixels for this CPU, or NULL for the
+inlined scalar one */
+static qoi_cpr_same_fn qoi_cpr_same_select(void) {
+	#ifdef QOI_X86_DISPATCH
+		switch (qoi_isa()) {
+			case QOI_ISA_AVX512:
+			case QOI_ISA_AVX2: return qoi_cpr_same_pixels_avx2;
+			case QOI_ISA_SSE42:
+			case QOI_ISA_SSE2: return qoi_cpr_same_pixels_sse2;
+		}
+	#endif
+	return NULL;
+}
+
+/* Threshold scale per code value for cfg->tone, by desc->colorspace: the
+average L* step of one code (100 / 255) over the L* step at that code,
+clamped to 1/8 .. 2 */
+static const float qoi_cpr_tone[2][256] = {
+	{
+		1.4303f, 1.4303f, 1.4303f, 1.4303f, 1.4303f, 1.4303f, 1.4303f, 1.4303f,
+		1.4303f, 1.4303f, 1.4244f, 1.3526f, 1.2804f, 1.2146f, 1.1544f, 1.0991f,
+		1.0482f, 1.0012f, 0.9577f, 0.9173f, 0.8798f, 0.8449f, 0.8122f, 0.7817f,
+		0.7688f, 0.7727f, 0.7766f, 0.7805f, 0.7842f, 0.7879f, 0.7916f, 0.7951f,
+		0.7986f, 0.8021f, 0.8054f, 0.8088f, 0.8120f, 0.8153f, 0.8184f, 0.8216f,
+		0.8246f, 0.8277f, 0.8307f, 0.8336f, 0.8365f, 0.8394f, 0.8422f, 0.8450f,
+		0.8477f, 0.8504f, 0.8531f, 0.8558f, 0.8584f, 0.8610f, 0.8635f, 0.8661f,
+		0.8686f, 0.8710f, 0.8735f, 0.8759f, 0.8783f, 0.8806f, 0.8830f, 0.8853f,
+		0.8875f, 0.8898f, 0.8921f, 0.8943f, 0.8965f, 0.8986f, 0.9008f, 0.9029f,
+		0.9050f, 0.9071f, 0.9092f, 0.9113f, 0.9133f, 0.9153f, 0.9173f, 0.9193f,
+		0.9213f, 0.9232f, 0.9252f, 0.9271f, 0.9290f, 0.9309f, 0.9328f, 0.9346f,
+		0.9365f, 0.9383f, 0.9401f, 0.9419f, 0.9437f, 0.9455f, 0.9472f, 0.9490f,
+		0.9507f, 0.9524f, 0.9541f, 0.9558f, 0.9575f, 0.9592f, 0.9609f, 0.9625f,
+		0.9641f, 0.9658f, 0.9674f, 0.9690f, 0.9706f, 0.9722f, 0.9738f, 0.9753f,
+		0.9769f, 0.9784f, 0.9800f, 0.9815f, 0.9830f, 0.9845f, 0.9860f, 0.9875f,
+		0.9890f, 0.9904f, 0.9919f, 0.9934f, 0.9948f, 0.9962f, 0.9977f, 0.9991f,
+		1.0005f, 1.0019f, 1.0033f, 1.0047f, 1.0061f, 1.0075f, 1.0088f, 1.0102f,
+		1.0115f, 1.0129f, 1.0142f, 1.0155f, 1.0169f, 1.0182f, 1.0195f, 1.0208f,
+		1.0221f, 1.0234f, 1.0247f, 1.0259f, 1.0272f, 1.0285f, 1.0297f, 1.0310f,
+		1.0322f, 1.0335f, 1.0347f, 1.0359f, 1.0372f, 1.0384f, 1.0396f, 1.0408f,
+		1.0420f, 1.0432f, 1.0444f, 1.0456f, 1.0467f, 1.0479f, 1.0491f, 1.0503f,
+		1.0514f, 1.0526f, 1.0537f, 1.0549f, 1.0560f, 1.0571f, 1.0583f, 1.0594f,
+		1.0605f, 1.0616f, 1.0627f, 1.0638f, 1.0649f, 1.0660f, 1.0671f, 1.0682f,
+		1.0693f, 1.0704f, 1.0714f, 1.0725f, 1.0736f, 1.0746f, 1.0757f, 1.0767f,
+		1.0778f, 1.0788f, 1.0799f, 1.0809f, 1.0819f, 1.0830f, 1.0840f, 1.0850f,
+		1.0860f, 1.0870f, 1.0880f, 1.0890f, 1.0901f, 1.0910f, 1.0920f, 1.0930f,
+		1.0940f, 1.0950f, 1.0960f, 1.0970f, 1.0979f, 1.0989f, 1.0999f, 1.1008f,
+		1.1018f, 1.1028f, 1.1037f, 1.1047f, 1.1056f, 1.1065f, 1.1075f, 1.1084f,
+		1.1094f, 1.1103f, 1.1112f, 1.1121f, 1.1131f, 1.1140f, 1.1149f, 1.1158f,
+		1.1167f, 1.1176f, 1.1185f, 1.1194f, 1.1203f, 1.1212f, 1.1221f, 1.1230f,
+		1.1239f, 1.1248f, 1.1256f, 1.1265f, 1.1274f, 1.1283f, 1.1291f, 1.1300f,
+		1.1309f, 1.1317f, 1.1326f, 1.1335f, 1.1343f, 1.1352f, 1.1360f, 1.1366f
+	},
+	{
+		0.1250f, 0.1250f, 0.1250f, 0.1331f, 0.1616f, 0.1877f, 0.2121f, 0.2351f,
+		0.2571f, 0.2781f, 0.2984f, 0.3180f, 0.3370f, 0.3555f, 0.3735f, 0.3911f,
+		0.4083f, 0.4251f, 0.4417f, 0.4579f, 0.4738f, 0.4895f, 0.5049f, 0.5201f,
+		0.5351f, 0.5498f, 0.5644f, 0.5788f, 0.5930f, 0.6070f, 0.6209f, 0.6346f,
+		0.6482f, 0.6616f, 0.6750f, 0.6881f, 0.7012f, 0.7141f, 0.7269f, 0.7396f,
+		0.7522f, 0.7647f, 0.7771f, 0.7894f, 0.8015f, 0.8136f, 0.8257f, 0.8376f,
+		0.8494f, 0.8612f, 0.8729f, 0.8845f, 0.8960f, 0.9074f, 0.9188f, 0.9301f,
+		0.9414f, 0.9525f, 0.9636f, 0.9747f, 0.9857f, 0.9966f, 1.0075f, 1.0183f,
+		1.0290f, 1.0397f, 1.0503f, 1.0609f, 1.0714f, 1.0819f, 1.0924f, 1.1027f,
+		1.1131f, 1.1233f, 1.1336f, 1.1438f, 1.1539f, 1.1640f, 1.1741f, 1.1841f,
+		1.1941f, 1.2040f, 1.2139f, 1.2237f, 1.2335f, 1.2433f, 1.2530f, 1.2627f,
+		1.2724f, 1.2820f, 1.2916f, 1.3012f, 1.3107f, 1.3201f, 1.3296f, 1.3390f,
+		1.3484f, 1.3577f, 1.3671f, 1.3763f, 1.3856f, 1.3948f, 1.4040f, 1.4132f,
+		1.4223f, 1.4314f, 1.4405f, 1.4495f, 1.4585f, 1.4675f, 1.4765f, 1.4854f,
+		1.4943f, 1.5032f, 1.5121f, 1.5209f, 1.5297f, 1.5385f, 1.5472f, 1.5560f,
+		1.5647f, 1.5734f, 1.5820f, 1.5906f, 1.5992f, 1.6078f, 1.6164f, 1.6249f,
+		1.6335f, 1.6420f, 1.6504f, 1.6589f, 1.6673f, 1.6757f, 1.6841f, 1.6925f,
+		1.7008f, 1.7092f, 1.7175f, 1.7258f, 1.7340f, 1.7423f, 1.7505f, 1.7587f,
+		1.7669f, 1.7751f, 1.7832f, 1.7913f, 1.7995f, 1.8076f, 1.8156f, 1.8237f,
+		1.8317f, 1.8398f, 1.8478f, 1.8558f, 1.8637f, 1.8717f, 1.8796f, 1.8876f,
+		1.8955f, 1.9034f, 1.9112f, 1.9191f, 1.9269f, 1.9348f, 1.9426f, 1.9504f,
+		1.9581f, 1.9659f, 1.9736f, 1.9814f, 1.9891f, 1.9968f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f,
+		2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f, 2.0000f
+	}
+};
+
+/* Size in floats of the row buffers of qoi_cpr_analyze_row. In size_t, as
+8 * width overflows an int for rows wider than 268M pixels */
+#define QOI_CPR_ROWS_FLOATS(width, vertical) ((size_t)(width) * 2 + ((size_t)(width) + 1) * 2 + ((vertical) ? (size_t)(width) * 4 : 0))
+#define QOI_CPR_ROWS_SIZE(width, vertical) (QOI_CPR_ROWS_FLOATS(width, vertical) * sizeof(float) + (size_t)(width) * sizeof(int))
+
+/* Compute the local_thresh pair of every pixel of row y, which starts at
+px_pos, into rows[0 .. 2 * width]. The contrast of a pixel is the smaller
+difference to its left and right neighbor. As the image is a single stream of
+pixels, this runs over row ends; the first pixel is compared to the initial
+{0, 0, 0, 255} and the last one to its left neighbor only. The right
+neighbor is compared unmultiplied.
+
+cfg->vertical: the smaller difference to the pixels above and below is
+averaged in (the minimum of both loses ~0.5 dB at the same size, the maximum
+gains nothing). The differences between a row and the row below are kept in a
+rolling pair of rows, so every pair of rows is compared once. The top and the
+bottom row use their single neighbor row for both sides.
+
+Then cfg->map scales the thresholds per block and tone (a qoi_cpr_tone table
+or NULL) the color threshold per pixel.
+
+Last, the row is classified for the emission stage: span[x] counts the pixels
+after x up to the row end that are identical to it as loaded (flat, emitted as
+a whole run). Whether a pixel can take the lossless path follows from its thresholds
+alone. */
+static QOI_FORCE_INLINE void qoi_cpr_analyze_row(float *rows, const unsigned char *pixels, int px_pos, int px_len, int width, int y, qoi_cpr_diff_fn diff, qoi_cpr_same_fn same, const qoi_cpr_cfg *cfg, const float *tone, const int channels, const int mulalpha) {
+	static const unsigned char px_start[4] = {0, 0, 0, 255};
+	const unsigned char *row = pixels + px_pos;
+	const unsigned char *row_end = row + (width - 1) * channels;
+	float *thresh = rows;
+	float *hdiff_c = rows + (size_t)width * 2, *hdiff_a = hdiff_c + (size_t)width + 1;
+	float *vdiff = hdiff_a + (size_t)width + 1;
+	float *vdiff_up = vdiff + ((y & 1) ? 0 : (size_t)width * 2), *vdiff_down = vdiff + ((y & 1) ? (size_t)width * 2 : 0);
+	int *span = (int *)(rows + QOI_CPR_ROWS_FLOATS(width, cfg->vertical));
+	int height = px_len / channels / width;
+	float diff_sum = (cfg->weights[0] + cfg->weights[1] + cfg->weights[2]) * 255.f;
+	int x;
+
+	if (!diff_sum) diff_sum = 1.f;
+
+	#define QOI_CPR_DIFF(dc, da, a, b, count, mul_a, mul_b) \
+		if (diff) diff(dc, da, a, b, count, cfg, channels, mul_a, mul_b); \
+		else qoi_cpr_diff_pixels(dc, da, a, b, count, cfg, channels, mul_a, mul_b)
+
+	QOI_CPR_DIFF(hdiff_c, hdiff_a, row, px_pos ? row - channels : px_start, 1, 0, mulalpha);
+	QOI_CPR_DIFF(hdiff_c + 1, hdiff_a + 1, row + channels, row, width - 1, 0, mulalpha);
+	if (px_pos + width * channels < px_len) {
+		QOI_CPR_DIFF(hdiff_c + width, hdiff_a + width, row_end + channels, row_end, 1, 0, mulalpha);
+	}
+	else {
+		QOI_CPR_DIFF(hdiff_c + width, hdiff_a + width, row_end == pixels ? px_start : row_end - channels, row_end, 1, mulalpha, mulalpha);
+	}
+
+	if (cfg->vertical && height > 1) {
+		if (y + 1 < height) {
+			QOI_CPR_DIFF(vdiff_down, vdiff_down + width, row, row + width * channels, width, mulalpha, mulalpha);
+		}
+		if (y == 0) {
+			memcpy(vdiff_up, vdiff_down, (size_t)width * 2 * sizeof(float));
+		}
+		else if (y + 1 == height) {
+			memcpy(vdiff_down, vdiff_up, (size_t)width * 2 * sizeof(float));
+		}
+	}
+	#undef QOI_CPR_DIFF
+
+	/* Branch free passes, so the compiler can vectorize them. hdiff[x]
+becomes the contrast of pixel x */
+	for (x = 0; x < width; x++) {
+		hdiff_c[x] = QOI_CPR_MIN(hdiff_c[x], hdiff_c[x + 1]);
+		hdiff_a[x] = QOI_CPR_MIN(hdiff_a[x], hdiff_a[x + 1]);
+	}
+	if (cfg->vertical && height > 1) {
+		for (x = 0; x < width; x++) {
+			hdiff_c[x] = (hdiff_c[x] + QOI_CPR_MIN(vdiff_up[x], vdiff_down[x])) * 0.5f;
+			hdiff_a[x] = (hdiff_a[x] + QOI_CPR_MIN(vdiff_up[width + x], vdiff_down[width + x])) * 0.5f;
+		}
+	}
+	for (x = 0; x < width; x++) {
+		float alpha = mulalpha && channels == 4 ? qoi_cpr_alpha[row[x * 4 + 3]] : 1.f;
+		float contrast_c = hdiff_c[x] / diff_sum * alpha;
+		float contrast_a = hdiff_a[x] / 255.f;
+		thresh[x * 2 + 0] = cfg->lothresh * (1 - contrast_c) + cfg->hithresh * contrast_c;
+		thresh[x * 2 + 1] = cfg->lothresh * (1 - contrast_a) + cfg->hithresh * contrast_a;
+	}
+
+	if (cfg->map) {
+		int block = cfg->map_block > 0 ? cfg->map_block : 8;
+		size_t stride = cfg->map_stride > 0 ? cfg->map_stride : (width + block - 1) / block;
+		const float *scale = cfg->map + (y / block) * stride;
+		for (x = 0; x < width; scale++) {
+			int x_end = QOI_CPR_MIN(x + block, width);
+			float s = *scale > 0 ? *scale : 0; /* also for NaN */
+			for (; x < x_end; x++) {
+				thresh[x * 2 + 0] *= s;
+				thresh[x * 2 + 1] *= s;
+			}
+		}
+	}
+
+	if (tone) {
+		for (x = 0; x < width; x++) {
+			const unsigned char *c = row + x * channels;
+			thresh[x * 2 + 0] *= tone[(c[0] + c[1] + c[1] + c[2]) >> 2];
+		}
+	}
+
+	if (same) same(span, row, width - 1, channels, mulalpha);
+	else qoi_cpr_same_pixels(span, row, width - 1, channels, mulalpha);
+	span[width - 1] = 0;
+	for (x = width - 2; x >= 0; x--) {
+		span[x] = span[x] ? span[x + 1] + 1 : 0;
+	}
+}
+
+/* Emission stage. rows is scratch space of QOI_CPR_ROWS_SIZE bytes */
+static QOI_FORCE_INLINE int qoi_cpr_encode_pixels(unsigned char *bytes, int p, const unsigned char *pixels, int px_len, int width, float *rows, const qoi_cpr_cfg *cfg, const float *tone, const int channels, const int mulalpha QOI_STATS_PARAM) {
+	int px_end, px_pos, run, x, y;
+	const float *local_thresh = rows;
+	qoi_rgba_t index[64];
+	unsigned long long mask;
+	qoi_rgba_t px, px_next, px_stored;
+	float alpha;
+	qoi_cpr_scan_fn scan = qoi_cpr_scan_select();
+	qoi_cpr_diff_fn diff = qoi_cpr_diff_select();
+	qoi_cpr_same_fn same = qoi_cpr_same_select();
+	int effort = cfg->effort ? cfg->effort : QOI_CPR_EFFORT_NORMAL;
+	int recent[QOI_CPR_RECENT] = {0};
+	unsigned char usage[64];
+	qoi_cpr_window_t window;
+	const int *span = (const int *)(rows + QOI_CPR_ROWS_FLOATS(width, cfg->vertical));
+
+	/* With zero thresholds and no zero weight only exact colors pass
+	compare_color, so the lossy path would make the same choices as
+	qoi_encode */
+	const int lossless = cfg->weights[0] > 0 && cfg->weights[1] > 0 && cfg->weights[2] > 0 && cfg->weights[3] > 0;
+
+	window.len = 0;
 	QOI_ZEROARR(index);
+	QOI_ZEROARR(usage);
 	mask = (unsigned long long)1;
 
 	run = 0;
 	px_stored.v = px.v = 0xff000000; /* {0, 0, 0, 255} */
-	px_next.rgba.r = pixels[0];
-	px_next.rgba.g = pixels[1];
-	px_next.rgba.b = pixels[2];
-	px_next.rgba.a = desc->channels == 4 ? pixels[3] : 255;
-
-	diff_prev[0] = abs(px_next.rgba.r - px.rgba.r) * cfg->weights[0]
-		+ abs(px_next.rgba.g - px.rgba.g) * cfg->weights[1]
-		+ abs(px_next.rgba.b - px.rgba.b) * cfg->weights[2];
-	diff_prev[1] = abs(px_next.rgba.a - px.rgba.a);
-	diff_sum = (cfg->weights[0] + cfg->weights[1] + cfg->weights[2]) * 255.f;
-	if (!diff_sum) diff_sum = 1.f;
+	px_next = qoi_cpr_load(pixels, channels, 0);
 
-	px_len = desc->width * desc->height * desc->channels;
-	px_end = px_len - desc->channels;
-	channels = desc->channels;
+	px_end = px_len - channels;
+	x = y = 0;
+
+	for (px_pos = 0; px_pos < px_len; px_pos += channels, x++) {
+		if (x == width) {
+			x = 0;
+			y++;
+		}
+		if (x == 0) {
+			qoi_cpr_analyze_row(rows, pixels, px_pos, px_len, width, y, diff, same, cfg, tone, channels, mulalpha);
+		}
+		local_thresh = rows + x * 2;
 
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		px_prev = px;
 		px = px_next;
 		alpha = 1.f;
 
-		if (cfg->mulalpha) {
+		if (mulalpha) {
 			px.v = px.rgba.a ? px.v : 0;
-			alpha = px.rgba.a / 255.f;
+			alpha = qoi_cpr_alpha[px.rgba.a];
 		}
 
 		if (px_pos + channels < px_len) {
-			px_next.rgba.r = pixels[px_pos + channels + 0];
-			px_next.rgba.g = pixels[px_pos + channels + 1];
-			px_next.rgba.b = pixels[px_pos + channels + 2];
+			px_next = qoi_cpr_load(pixels + px_pos + channels, channels, 0);
+		}
 
-			if (channels == 4) {
-				px_next.rgba.a = pixels[px_pos + channels + 3];
+		if (effort >= QOI_CPR_EFFORT_TRELLIS) {
+			window.px[window.len] = px;
+			window.alpha[window.len] = alpha;
+			window.thresh[window.len][0] = local_thresh[0];
+			window.thresh[window.len][1] = local_thresh[1];
+			window.len++;
+			if (window.len == QOI_CPR_TRELLIS_WINDOW || px_pos == px_end) {
+				p = qoi_cpr_encode_window(bytes, p, &window, px_pos == px_end, index, &mask, &px_stored, &run, cfg QOI_STATS_ARG);
+				window.len = 0;
 			}
+			continue;
 		}
-		else {
-			px_next = px_prev; /* Keep maximum contrast */
+
+		/* Flat span: the identical pixels that follow join the run at once */
+		if (px.v == px_stored.v) {
+			int n = span[x];
+			run += n + 1;
+			x += n;
+			px_pos += n * channels;
+			for (; run >= 62; run -= 62) {
+				bytes[p++] = QOI_OP_RUN | 61;
+				QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
+			}
+			if (px_pos == px_end) {
+				p = qoi_cpr_flush_run(bytes, p, &run QOI_STATS_ARG);
+			}
+			else if (n) {
+				px_next = qoi_cpr_load(pixels + px_pos + channels, channels, 0);
+			}
+			continue;
 		}
 
-		diff_next[0] = abs(px_next.rgba.r - px.rgba.r) * cfg->weights[0]
-			+ abs(px_next.rgba.g - px.rgba.g) * cfg->weights[1]
-			+ abs(px_next.rgba.b - px.rgba.b) * cfg->weights[2];
-		diff_next[1] = abs(px_next.rgba.a - px.rgba.a);
+		/* Exact span: the plain lossless cascade, without the index scan and
+		float compares */
+		if (lossless && local_thresh[0] == 0 && local_thresh[1] == 0 && (!mulalpha || px.rgba.a)) {
+			int index_pos = QOI_COLOR_HASH(px) % 64;
 
-		float contrast = QOI_CPR_MIN(diff_prev[0], diff_next[0]) / diff_sum * alpha;
-		local_thresh[0] = cfg->lothresh * (1 - contrast) + cfg->hithresh * contrast;
-		diff_prev[0] = diff_next[0];
+			p = qoi_cpr_flush_run(bytes, p, &run QOI_STATS_ARG);
+			QOI_STATS_ADD(index_lookups, 1);
 
-		contrast = QOI_CPR_MIN(diff_prev[1], diff_next[1]) / 255.f;
-		local_thresh[1] = cfg->lothresh * (1 - contrast) + cfg->hithresh * contrast;
-		diff_prev[1] = diff_next[1];
+			if (index[index_pos].v == px.v) {
+				bytes[p++] = QOI_OP_INDEX | index_pos;
+				QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+				QOI_STATS_ADD(index_hits, 1);
+				usage[index_pos] += usage[index_pos] < 255;
+			}
+			else {
+				int n = qoi_cpr_encode_exact(bytes + p, px_stored, px);
+				p += n;
+				QOI_STATS_OP(
+					n == 1 ? QOI_STATS_OP_DIFF :
+					n == 2 ? QOI_STATS_OP_LUMA :
+					n == 4 ? QOI_STATS_OP_RGB : QOI_STATS_OP_RGBA,
+					n
+				);
+				index[index_pos] = px;
+				usage[index_pos] = 0;
+				mask |= (unsigned long long)1 << index_pos;
+			}
+			px_stored = px;
+			if (effort == QOI_CPR_EFFORT_FAST) {
+				qoi_cpr_touch_recent(recent, index_pos);
+			}
+			continue;
+		}
 
-		if (px.v == px_stored.v || compare_color(px, alpha, px_stored, local_thresh, cfg, NULL)) {
+		if ((QOI_STATS_ADD(cpr_compares, 1), compare_color(px, alpha, px_stored, local_thresh, cfg, NULL))) {
 			run++;
 			if (run == 62 || px_pos == px_end) {
 				bytes[p++] = QOI_OP_RUN | (run - 1);
+				QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
 				run = 0;
 			}
 		}
@@ -219,105 +1521,225 @@ void *qoi_cpr_encode(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *
 
 			if (run > 0) {
 				bytes[p++] = QOI_OP_RUN | (run - 1);
+				QOI_STATS_OP(QOI_STATS_OP_RUN, 1);
 				run = 0;
 			}
 
 			index_pos = QOI_COLOR_HASH(px) % 64;
+			QOI_STATS_ADD(index_lookups, 1);
 
 			if (index[index_pos].v == px.v) {
 				bytes[p++] = QOI_OP_INDEX | index_pos;
+				QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+				QOI_STATS_ADD(index_hits, 1);
 				px_stored = index[index_pos];
+				usage[index_pos] += usage[index_pos] < 255;
+				if (effort == QOI_CPR_EFFORT_FAST) {
+					qoi_cpr_touch_recent(recent, index_pos);
+				}
 				continue;
 			}
 
-			float score_min = QOI_CPR_MAXFLOAT;
-			float score;
+			/* The next pixel as it will be compared, for the lookahead */
+			qoi_rgba_t px_ahead = px_next;
+			float alpha_ahead = 1.f;
+			if (mulalpha) {
+				px_ahead.v = px_ahead.rgba.a ? px_ahead.v : 0;
+				alpha_ahead = qoi_cpr_alpha[px_ahead.rgba.a];
+			}
+			int lookahead = effort >= QOI_CPR_EFFORT_LOOKAHEAD && px_pos != px_end;
 
-			index_pos = -1;
+			if (effort == QOI_CPR_EFFORT_FAST) {
+				index_pos = qoi_cpr_scan_recent(index, mask, recent, px, alpha, local_thresh, cfg QOI_STATS_ARG);
+			}
+			else {
+				if (scan) {
+					index_pos = scan(index, mask, px, alpha, local_thresh, cfg);
+					QOI_STATS_ADD(cpr_compares, qoi_cpr_popcount(mask));
+				}
+				else {
+					index_pos = qoi_cpr_scan_index(index, mask, px, alpha, local_thresh, cfg QOI_STATS_ARG);
+				}
 
-			for (i = 0; i < 64; i++) {
+				/* If the closest entry already covers the next pixel, it is
+				also what the lookahead scan would pick */
 				if (
-					/* Make sure color is valid
-					The behavior to update the index of invalid color is undefined */
-					(mask & ((unsigned long long)1 << i)) &&
-					compare_color(px, alpha, index[i], local_thresh, cfg, &score) &&
-					score < score_min
+					lookahead && index_pos >= 0 &&
+					(QOI_STATS_ADD(cpr_compares, 1), !compare_color(px_ahead, alpha_ahead, index[index_pos], local_thresh, cfg, NULL))
 				) {
-					score_min = score;
-					index_pos = i;
+					index_pos = qoi_cpr_scan_index_lookahead(index, mask, px, alpha, px_ahead, alpha_ahead, local_thresh, cfg QOI_STATS_ARG);
 				}
 			}
 
 			if (index_pos >= 0) {
 				bytes[p++] = QOI_OP_INDEX | index_pos;
+				QOI_STATS_OP(QOI_STATS_OP_INDEX, 1);
+				QOI_STATS_ADD(cpr_scan_hits, 1);
 				px_stored = index[index_pos];
+				usage[index_pos] += usage[index_pos] < 255;
 			}
 			else {
-				if (abs(px.rgba.a - px_stored.rgba.a) * cfg->weights[3] <= local_thresh[1]) {
-					signed char vr = px.rgba.r - px_stored.rgba.r;
-					signed char vg = px.rgba.g - px_stored.rgba.g;
-					signed char vb = px.rgba.b - px_stored.rgba.b;
-
-					signed char _vr = QOI_CPR_CLAMP(vr, -2, 1);
-					signed char _vg = QOI_CPR_CLAMP(vg, -2, 1);
-					signed char _vb = QOI_CPR_CLAMP(vb, -2, 1);
-
-					qoi_rgba_t px_potential = {
-						.rgba.r = px_stored.rgba.r + _vr,
-						.rgba.g = px_stored.rgba.g + _vg,
-						.rgba.b = px_stored.rgba.b + _vb,
-						.rgba.a = px_stored.rgba.a
-					};
-
-					if (px.v == px_potential.v || compare_color(px, alpha, px_potential, local_thresh, cfg, NULL)) {
-						bytes[p++] = QOI_OP_DIFF | (_vr + 2) << 4 | (_vg + 2) << 2 | (_vb + 2);
-						px_stored = px_potential;
-					}
-					else {
-						_vg = QOI_CPR_CLAMP(vg, -32, 31);
-						signed char vg_r = vr - _vg;
-						signed char vg_b = vb - _vg;
-						vg_r = QOI_CPR_CLAMP(vg_r, -8, 7);
-						vg_b = QOI_CPR_CLAMP(vg_b, -8, 7);
-
-						px_stored.rgba.r += _vg + vg_r;
-						px_stored.rgba.g += _vg;
-						px_stored.rgba.b += _vg + vg_b;
-
-						if (px.v == px_stored.v || compare_color(px, alpha, px_stored, local_thresh, cfg, NULL)) {
-							bytes[p++] = QOI_OP_LUMA     | (_vg  + 32);
-							bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
-						}
-						else {
-							bytes[p++] = QOI_OP_RGB;
-							px_stored = *(qoi_rgba_t *)(bytes + p) = px;
-							p += 3;
-							px_stored.rgba.a = px_potential.rgba.a;
-						}
+				qoi_rgba_t px_delta = px_stored;
+				int n;
+
+				QOI_STATS_ADD(cpr_scan_misses, 1);
+				n = qoi_cpr_encode_delta(bytes + p, &px_delta, px, alpha, local_thresh, cfg QOI_STATS_ARG);
+
+				/* Try to aim between this and the next pixel instead, if that
+				covers both and is no larger */
+				if (
+					lookahead && n > 1 &&
+					(QOI_STATS_ADD(cpr_compares, 1), !compare_color(px_ahead, alpha_ahead, px_delta, local_thresh, cfg, NULL))
+				) {
+					unsigned char alt[5];
+					qoi_rgba_t px_alt = px_stored;
+					qoi_rgba_t px_mid = px;
+					px_mid.rgba.r = (px.rgba.r + px_ahead.rgba.r + 1) >> 1;
+					px_mid.rgba.g = (px.rgba.g + px_ahead.rgba.g + 1) >> 1;
+					px_mid.rgba.b = (px.rgba.b + px_ahead.rgba.b + 1) >> 1;
+
+					int n_alt = qoi_cpr_encode_delta(alt, &px_alt, px_mid, alpha, local_thresh, cfg QOI_STATS_ARG);
+					if (
+						n_alt <= n &&
+						(QOI_STATS_ADD(cpr_compares, 2), compare_color(px, alpha, px_alt, local_thresh, cfg, NULL)) &&
+						compare_color(px_ahead, alpha_ahead, px_alt, local_thresh, cfg, NULL)
+					) {
+						memcpy(bytes + p, alt, n_alt);
+						n = n_alt;
+						px_delta = px_alt;
 					}
 				}
-				else {
-					bytes[p++] = QOI_OP_RGBA;
-					*(qoi_rgba_t *)(bytes + p) = px;
-					p += 4;
-					px_stored = px;
+
+				if (cfg->protect) {
+					int n_cold = qoi_cpr_protect_slot(bytes + p, px_stored, &px_delta, n, px, alpha, local_thresh, index, mask, usage, cfg QOI_STATS_ARG);
+					n = n_cold ? n_cold : n;
 				}
 
+				p += n;
+				px_stored = px_delta;
+				QOI_STATS_OP(
+					n == 1 ? QOI_STATS_OP_DIFF :
+					n == 2 ? QOI_STATS_OP_LUMA :
+					n == 4 ? QOI_STATS_OP_RGB : QOI_STATS_OP_RGBA,
+					n
+				);
+
 				index_pos = QOI_COLOR_HASH(px_stored) % 64;
 				index[index_pos] = px_stored;
+				usage[index_pos] = 0;
 				mask |= (unsigned long long)1 << index_pos;
 			}
+
+			if (effort == QOI_CPR_EFFORT_FAST) {
+				qoi_cpr_touch_recent(recent, index_pos);
+			}
 		}
 	}
 
+	return p;
+}
+
+static int qoi_cpr_encode_pixels_rgb(unsigned char *bytes, int p, const unsigned char *pixels, int px_len, int width, float *rows, const qoi_cpr_cfg *cfg, const float *tone QOI_STATS_PARAM) {
+	return qoi_cpr_encode_pixels(bytes, p, pixels, px_len, width, rows, cfg, tone, 3, 0 QOI_STATS_ARG);
+}
+
+static int qoi_cpr_encode_pixels_rgba(unsigned char *bytes, int p, const unsigned char *pixels, int px_len, int width, float *rows, const qoi_cpr_cfg *cfg, const float *tone QOI_STATS_PARAM) {
+	return qoi_cpr_encode_pixels(bytes, p, pixels, px_len, width, rows, cfg, tone, 4, 0 QOI_STATS_ARG);
+}
+
+static int qoi_cpr_encode_pixels_rgb_mul(unsigned char *bytes, int p, const unsigned char *pixels, int px_len, int width, float *rows, const qoi_cpr_cfg *cfg, const float *tone QOI_STATS_PARAM) {
+	return qoi_cpr_encode_pixels(bytes, p, pixels, px_len, width, rows, cfg, tone, 3, 1 QOI_STATS_ARG);
+}
+
+static int qoi_cpr_encode_pixels_rgba_mul(unsigned char *bytes, int p, const unsigned char *pixels, int px_len, int width, float *rows, const qoi_cpr_cfg *cfg, const float *tone QOI_STATS_PARAM) {
+	return qoi_cpr_encode_pixels(bytes, p, pixels, px_len, width, rows, cfg, tone, 4, 1 QOI_STATS_ARG);
+}
+
+#ifdef QOI_STATS
+void *qoi_cpr_encode_stats(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int *out_len, qoi_stats *stats) {
+#else
+void *qoi_cpr_encode(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int *out_len) {
+#endif
+	int i, max_size, p, px_len;
+	unsigned char *bytes;
+	const unsigned char *pixels;
+	const float *tone;
+	float *rows;
+
+	if (
+		data == NULL || out_len == NULL || desc == NULL ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4 ||
+		desc->colorspace > 1 ||
+		desc->height >= QOI_PIXELS_MAX / desc->width
+	) {
+		return NULL;
+	}
+
+	/* A map row must hold a value for every block of an image row */
+	if (cfg->map && cfg->map_stride) {
+		unsigned int block = cfg->map_block > 0 ? cfg->map_block : 8;
+		if (cfg->map_stride < 0 || (unsigned int)cfg->map_stride < (desc->width + block - 1) / block) {
+			return NULL;
+		}
+	}
+
+	max_size =
+		desc->width * desc->height * (desc->channels + 1) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding) + QOI_CRC_SIZE;
+
+	p = 0;
+	bytes = (unsigned char *) QOI_MALLOC(max_size);
+	if (!bytes) {
+		return NULL;
+	}
+
+	rows = (float *) QOI_MALLOC(QOI_CPR_ROWS_SIZE(desc->width, cfg->vertical));
+	if (!rows) {
+		QOI_FREE(bytes);
+		return NULL;
+	}
+
+	qoi_write_32(bytes, &p, QOI_MAGIC);
+	qoi_write_32(bytes, &p, desc->width);
+	qoi_write_32(bytes, &p, desc->height);
+	bytes[p++] = desc->channels;
+	bytes[p++] = desc->colorspace;
+
+
+	pixels = (const unsigned char *)data;
+	px_len = desc->width * desc->height * desc->channels;
+	tone = cfg->tone ? qoi_cpr_tone[desc->colorspace] : NULL;
+
+	if (desc->channels == 4) {
+		p = cfg->mulalpha ?
+			qoi_cpr_encode_pixels_rgba_mul(bytes, p, pixels, px_len, desc->width, rows, cfg, tone QOI_STATS_ARG) :
+			qoi_cpr_encode_pixels_rgba(bytes, p, pixels, px_len, desc->width, rows, cfg, tone QOI_STATS_ARG);
+	}
+	else {
+		p = cfg->mulalpha ?
+			qoi_cpr_encode_pixels_rgb_mul(bytes, p, pixels, px_len, desc->width, rows, cfg, tone QOI_STATS_ARG) :
+			qoi_cpr_encode_pixels_rgb(bytes, p, pixels, px_len, desc->width, rows, cfg, tone QOI_STATS_ARG);
+	}
+
 	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
 		bytes[p++] = qoi_padding[i];
 	}
+	#ifdef QOI_CRC
+		p = qoi_write_crc(bytes, p);
+	#endif
 
+	QOI_FREE(rows);
 	*out_len = p;
 	return bytes;
 }
 
+#ifdef QOI_STATS
+void *qoi_cpr_encode(const void *data, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int *out_len) {
+	return qoi_cpr_encode_stats(data, desc, cfg, out_len, NULL);
+}
+#endif
+
 #ifndef QOI_NO_STDIO
 #include <stdio.h>
 
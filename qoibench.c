@@ -1,10 +1,13 @@
 /*
 
-Simple benchmark suite for png, stbi and qoi
+Simple benchmark suite for png, stbi, qoi and qoi_cpr
 
 Requires libpng, "stb_image.h" and "stb_image_write.h"
 Compile with: 
-	gcc qoibench.c -std=gnu99 -lpng -O3 -o qoibench 
+	gcc qoibench.c -std=gnu99 -lpng -lm -lpthread -O3 -o qoibench 
+
+Add -DQOI_STATS to enable --opstats. This compiles the chunk counters into
+all en-/decoders, so don't compare timings against a build without it.
 
 Dominic Szablewski - https://phoboslab.org
 
@@ -32,7 +35,9 @@ SOFTWARE.
 */
 
 #include <stdio.h>
+#include <math.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <png.h>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -44,7 +49,7 @@ SOFTWARE.
 #include "stb_image_write.h"
 
 #define QOI_IMPLEMENTATION
-#include "qoi.h"
+#include "qoi_cpr.h"
 
 
 
@@ -111,6 +116,116 @@ static uint64_t ns() {
 #define ERROR(...) printf("abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); printf("\n"); exit(1)
 
 
+// -----------------------------------------------------------------------------
+// Hardware performance counters (Linux only)
+// With --perf each benchmarked region is wrapped with perf_event_open counters
+// for the calling thread. Counters the host doesn't support read as 0. The
+// counters are opened as one group, so they always count the same time window.
+// If the PMU has to multiplex them, the counts are scaled up by the fraction of
+// the time the group was actually running.
+
+#if defined(__linux)
+	#define HAVE_PERF_EVENTS
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_COUNTER_COUNT
+};
+
+int opt_perf = 0;
+int perf_leader = -1;
+int perf_group_count = 0;
+int perf_group_order[PERF_COUNTER_COUNT]; // counter of each value in a group read
+int perf_multiplexed = 0;
+
+#ifdef HAVE_PERF_EVENTS
+int perf_open(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = perf_leader < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	int fd = syscall(__NR_perf_event_open, &attr, 0, -1, perf_leader, 0);
+	if (fd >= 0 && perf_leader < 0) {
+		perf_leader = fd;
+	}
+	return fd;
+}
+
+void perf_add(int counter, uint32_t type, uint64_t config) {
+	if (perf_open(type, config) >= 0) {
+		perf_group_order[perf_group_count++] = counter;
+	}
+}
+#endif
+
+void perf_init() {
+#ifdef HAVE_PERF_EVENTS
+	perf_add(PERF_CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	perf_add(PERF_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	perf_add(PERF_BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	perf_add(PERF_L1D_MISSES, PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+	);
+	perf_add(PERF_LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+	if (perf_leader < 0) {
+		ERROR("perf_event_open failed, check /proc/sys/kernel/perf_event_paranoid");
+	}
+#else
+	ERROR("--perf is only supported on Linux");
+#endif
+}
+
+void perf_start() {
+#ifdef HAVE_PERF_EVENTS
+	ioctl(perf_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+// Stop all counters and add their values, scaled to the whole enabled time,
+// to counts
+void perf_stop(uint64_t *counts) {
+#ifdef HAVE_PERF_EVENTS
+	ioctl(perf_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	// nr, time_enabled, time_running, one value per counter
+	uint64_t values[3 + PERF_COUNTER_COUNT];
+	int size = (3 + perf_group_count) * sizeof(uint64_t);
+	if (read(perf_leader, values, size) != size || values[2] == 0) {
+		return;
+	}
+	double scale = 1.0;
+	if (values[2] < values[1]) {
+		scale = (double)values[1] / values[2];
+		if (!perf_multiplexed) {
+			perf_multiplexed = 1;
+			printf("warning: perf counters were multiplexed, counts are scaled estimates\n");
+		}
+	}
+	for (int i = 0; i < perf_group_count; i++) {
+		counts[perf_group_order[i]] += values[3 + i] * scale;
+	}
+#endif
+}
+
+
 // -----------------------------------------------------------------------------
 // libpng encode/decode wrappers
 // Seriously, who thought this was a good abstraction for an API to read/write
@@ -165,8 +280,9 @@ void *libpng_encode(void *pixels, int w, int h, int channels, int *out_len) {
 
 	libpng_write_t write_data = {
 		.size = 0,
-		.capacity = w * h * channels,
-		.data = malloc(w * h * channels)
+		// Incompressible images (noise) come out slightly larger than raw
+		.capacity = w * h * channels + w * h * channels / 50 + h + 4096,
+		.data = malloc(w * h * channels + w * h * channels / 50 + h + 4096)
 	};
 
 	png_set_rows(png, info, row_pointers);
@@ -321,14 +437,220 @@ int opt_nodecode = 0;
 int opt_noencode = 0;
 int opt_norecurse = 0;
 int opt_onlytotals = 0;
+int opt_cpr = 0;
+int opt_rdcurve = 0;
+int opt_threads = 0;
+int opt_timing = 0;
+int opt_opstats = 0;
+int opt_synthetic = 0;
+int opt_synthetic_max = 0;
+
 
+// -----------------------------------------------------------------------------
+// qoi_cpr settings grid. With --cpr every combination of the lo, hi, weights,
+// mulalpha, effort, protect, vertical, space and tone lists below is benchmarked. The lists
+// can be replaced on the command line.
+
+#define CPR_GRID_MAX 4
+#define CPR_SETTINGS_MAX 256
+
+float cpr_grid_lo[CPR_GRID_MAX] = {0.6f, 2.0f};
+int cpr_grid_lo_count = 2;
+float cpr_grid_hi[CPR_GRID_MAX] = {48.0f, 96.0f, 160.0f};
+int cpr_grid_hi_count = 3;
+float cpr_grid_weights[CPR_GRID_MAX * 4] = {0.6f, 1.0f, 0.4f, 1.0f};
+int cpr_grid_weights_count = 1;
+int cpr_grid_mulalpha[2] = {0, 1};
+int cpr_grid_mulalpha_count = 2;
+int cpr_grid_effort[CPR_GRID_MAX] = {QOI_CPR_EFFORT_DEFAULT};
+int cpr_grid_effort_count = 1;
+int cpr_grid_protect[2] = {0};
+int cpr_grid_protect_count = 1;
+int cpr_grid_vertical[2] = {0};
+int cpr_grid_vertical_count = 1;
+int cpr_grid_space[2] = {QOI_CPR_SPACE_RGB};
+int cpr_grid_space_count = 1;
+int cpr_grid_tone[2] = {0};
+int cpr_grid_tone_count = 1;
+
+qoi_cpr_cfg cpr_settings[CPR_SETTINGS_MAX];
+int cpr_settings_count = 0;
+
+// Parse a list of numbers separated by "," or ":" into out, return the count
+int parse_float_list(const char *arg, float *out, int max) {
+	int count = 0;
+	const char *s = arg;
+	while (*s) {
+		char *end;
+		if (count == max) {
+			ERROR("Too many values in %s (max %d)", arg, max);
+		}
+		out[count++] = strtof(s, &end);
+		if (end == s || (*end && *end != ',' && *end != ':')) {
+			ERROR("Invalid list %s", arg);
+		}
+		s = *end ? end + 1 : end;
+	}
+	return count;
+}
+
+// Parse a list of integers separated by "," or ":" into out, return the count
+int parse_int_list(const char *arg, int *out, int max) {
+	int count = 0;
+	const char *s = arg;
+	while (*s) {
+		char *end;
+		if (count == max) {
+			ERROR("Too many values in %s (max %d)", arg, max);
+		}
+		out[count++] = (int)strtol(s, &end, 10);
+		if (end == s || (*end && *end != ',' && *end != ':')) {
+			ERROR("Invalid list %s", arg);
+		}
+		s = *end ? end + 1 : end;
+	}
+	return count;
+}
+
+void cpr_set_weights(qoi_cpr_cfg *cfg, const void *values, int i) {
+	for (int c = 0; c < 4; c++) {
+		cfg->weights[c] = ((const float *)values)[i * 4 + c];
+	}
+}
+void cpr_set_mulalpha(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->mulalpha = ((const int *)values)[i] != 0; }
+void cpr_set_effort(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->effort = ((const int *)values)[i]; }
+void cpr_set_protect(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->protect = ((const int *)values)[i] != 0; }
+void cpr_set_vertical(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->vertical = ((const int *)values)[i] != 0; }
+void cpr_set_space(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->space = ((const int *)values)[i]; }
+void cpr_set_tone(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->tone = ((const int *)values)[i] != 0; }
+void cpr_set_lo(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->lothresh = ((const float *)values)[i]; }
+void cpr_set_hi(qoi_cpr_cfg *cfg, const void *values, int i) { cfg->hithresh = ((const float *)values)[i]; }
+
+typedef struct {
+	const void *values;
+	const int *count;
+	void (*set)(qoi_cpr_cfg *cfg, const void *values, int i);
+} cpr_axis_t;
+
+// The grid axes, outermost first. A new qoi_cpr_cfg field only needs a list,
+// a setter and an entry here.
+const cpr_axis_t cpr_axes[] = {
+	{cpr_grid_weights, &cpr_grid_weights_count, cpr_set_weights},
+	{cpr_grid_mulalpha, &cpr_grid_mulalpha_count, cpr_set_mulalpha},
+	{cpr_grid_effort, &cpr_grid_effort_count, cpr_set_effort},
+	{cpr_grid_protect, &cpr_grid_protect_count, cpr_set_protect},
+	{cpr_grid_vertical, &cpr_grid_vertical_count, cpr_set_vertical},
+	{cpr_grid_space, &cpr_grid_space_count, cpr_set_space},
+	{cpr_grid_tone, &cpr_grid_tone_count, cpr_set_tone},
+	{cpr_grid_lo, &cpr_grid_lo_count, cpr_set_lo},
+	{cpr_grid_hi, &cpr_grid_hi_count, cpr_set_hi},
+};
+#define CPR_AXES (int)(sizeof(cpr_axes) / sizeof(cpr_axes[0]))
+
+// Walk every combination of the axes with a mixed-radix counter, the last
+// axis changing fastest
+void cpr_build_settings() {
+	int idx[CPR_AXES];
+	int count = 1;
+	for (int a = 0; a < CPR_AXES; a++) {
+		idx[a] = 0;
+		count *= *cpr_axes[a].count;
+	}
+	if (count > CPR_SETTINGS_MAX) {
+		ERROR("Too many qoi_cpr settings %d (max %d)", count, CPR_SETTINGS_MAX);
+	}
+
+	for (cpr_settings_count = 0; cpr_settings_count < count; cpr_settings_count++) {
+		qoi_cpr_cfg *cfg = &cpr_settings[cpr_settings_count];
+		memset(cfg, 0, sizeof(*cfg));
+		for (int a = 0; a < CPR_AXES; a++) {
+			cpr_axes[a].set(cfg, cpr_axes[a].values, idx[a]);
+		}
+		for (int a = CPR_AXES - 1; a >= 0 && ++idx[a] == *cpr_axes[a].count; a--) {
+			idx[a] = 0;
+		}
+	}
+}
+
+// Name of a qoi_cpr setting in tables and exports. The effort, protect, vertical, space
+// and tone are only added when set, so names stay comparable with older --json baselines.
+void cpr_name(char *name, size_t size, const qoi_cpr_cfg *cfg) {
+	int len = snprintf(
+		name, size, "qoi_cpr %.2f %.1f %.0f/%.0f/%.0f/%.0f %d",
+		cfg->lothresh, cfg->hithresh,
+		cfg->weights[0] * 100, cfg->weights[1] * 100, cfg->weights[2] * 100, cfg->weights[3] * 100,
+		cfg->mulalpha
+	);
+	if (cfg->effort && len > 0 && (size_t)len < size) {
+		len += snprintf(name + len, size - len, " e%d", cfg->effort);
+	}
+	if (cfg->protect && len > 0 && (size_t)len < size) {
+		len += snprintf(name + len, size - len, " p");
+	}
+	if (cfg->vertical && len > 0 && (size_t)len < size) {
+		len += snprintf(name + len, size - len, " v");
+	}
+	if (cfg->space == QOI_CPR_SPACE_YCOCG && len > 0 && (size_t)len < size) {
+		len += snprintf(name + len, size - len, " ycocg");
+	}
+	if (cfg->tone && len > 0 && (size_t)len < size) {
+		snprintf(name + len, size - len, " t");
+	}
+}
+
+// Accumulate the squared and the maximum channel error between the source
+// pixels and the decoded qoi_cpr output. With mulalpha the color channels are
+// compared premultiplied, since the encoder is free to change the color of
+// (partly) transparent pixels.
+void cpr_measure_error(const unsigned char *a, const unsigned char *b, int px, int channels, int mulalpha, double *sq_error, int *max_error) {
+	for (int i = 0; i < px * channels; i += channels) {
+		for (int c = 0; c < channels; c++) {
+			int va = a[i + c];
+			int vb = b[i + c];
+			if (mulalpha && channels == 4 && c < 3) {
+				va = (va * a[i + 3] + 127) / 255;
+				vb = (vb * b[i + 3] + 127) / 255;
+			}
+			int err = abs(va - vb);
+			*sq_error += err * err;
+			if (err > *max_error) {
+				*max_error = err;
+			}
+		}
+	}
+}
+
+
+// Distribution of the run times of one benchmarked function in ns. Totals
+// (directories and the grand total) add up the samples run by run, so run i
+// of a total is the time of the i-th pass over all of its images, and the
+// distribution is taken over these passes.
+typedef struct {
+	uint64_t avg;
+	uint64_t min;
+	uint64_t median;
+	uint64_t p90;
+	uint64_t p99;
+	double var;
+	int runs;
+	uint64_t *samples; // run times in run order, freed by benchmark_result_free()
+	uint64_t perf[PERF_COUNTER_COUNT]; // per run average, with --perf
+} benchmark_time_t;
 
 typedef struct {
 	uint64_t size;
-	uint64_t encode_time;
-	uint64_t decode_time;
+	benchmark_time_t encode_time;
+	benchmark_time_t decode_time;
 } benchmark_lib_result_t;
 
+typedef struct {
+	uint64_t size;
+	benchmark_time_t encode_time;
+	benchmark_time_t decode_time;
+	double sq_error;
+	int max_error;
+} benchmark_cpr_result_t;
+
 typedef struct {
 	int count;
 	uint64_t raw_size;
@@ -338,20 +660,469 @@ typedef struct {
 	benchmark_lib_result_t libpng;
 	benchmark_lib_result_t stbi;
 	benchmark_lib_result_t qoi;
+	benchmark_cpr_result_t cpr[CPR_SETTINGS_MAX];
+#ifdef QOI_STATS
+	qoi_stats qoi_stats;
+	qoi_stats cpr_stats[CPR_SETTINGS_MAX];
+#endif
 } benchmark_result_t;
 
 
-void benchmark_print_result(benchmark_result_t res) {
+#ifdef QOI_STATS
+void qoi_stats_add(qoi_stats *total, const qoi_stats *stats) {
+	for (int op = 0; op < QOI_STATS_OP_COUNT; op++) {
+		total->ops[op] += stats->ops[op];
+		total->op_bytes[op] += stats->op_bytes[op];
+	}
+	total->index_lookups += stats->index_lookups;
+	total->index_hits += stats->index_hits;
+	total->cpr_scan_hits += stats->cpr_scan_hits;
+	total->cpr_scan_misses += stats->cpr_scan_misses;
+	total->cpr_compares += stats->cpr_compares;
+}
+
+// One row of the chunk statistics: the share of each op in the number of
+// chunks and in the number of bytes, the index hit rate and for qoi_cpr the
+// 64-entry scan hit rate and the number of compare_color calls per pixel
+void benchmark_print_opstats_row(const char *name, const qoi_stats *st, uint64_t px) {
+	uint64_t chunks = 0;
+	uint64_t bytes = 0;
+	for (int op = 0; op < QOI_STATS_OP_COUNT; op++) {
+		chunks += st->ops[op];
+		bytes += st->op_bytes[op];
+	}
+	if (!chunks) {
+		return;
+	}
+
+	printf("%-36s", name);
+	for (int op = 0; op < QOI_STATS_OP_COUNT; op++) {
+		printf(
+			"  %5.1f/%5.1f",
+			(double)st->ops[op] / chunks * 100.0,
+			(double)st->op_bytes[op] / bytes * 100.0
+		);
+	}
+	printf(
+		"  %6.1f%%",
+		st->index_lookups ? (double)st->index_hits / st->index_lookups * 100.0 : 0
+	);
+	if (st->cpr_scan_hits + st->cpr_scan_misses) {
+		printf(
+			"  %6.1f%%  %8.2f",
+			(double)st->cpr_scan_hits / (st->cpr_scan_hits + st->cpr_scan_misses) * 100.0,
+			(double)st->cpr_compares / px
+		);
+	}
+	printf("\n");
+}
+
+void benchmark_print_opstats(const benchmark_result_t *res) {
+	const char *op_names[QOI_STATS_OP_COUNT] = {"run", "index", "diff", "luma", "rgb", "rgba"};
+	printf("%-36s", "chunks%/bytes%");
+	for (int op = 0; op < QOI_STATS_OP_COUNT; op++) {
+		printf("%13s", op_names[op]);
+	}
+	printf("%9s%9s%10s\n", "idx hit", "scan hit", "cmp/px");
+	benchmark_print_opstats_row("qoi", &res->qoi_stats, res->px);
+	if (opt_cpr) {
+		for (int s = 0; s < cpr_settings_count; s++) {
+			const qoi_cpr_cfg *cfg = &cpr_settings[s];
+			char name[64];
+			cpr_name(name, sizeof(name), cfg);
+			benchmark_print_opstats_row(name, &res->cpr_stats[s], res->px);
+		}
+	}
+}
+#endif
+
+
+double cpr_psnr(double sq_error, uint64_t samples) {
+	if (sq_error == 0) {
+		return INFINITY;
+	}
+	return 10.0 * log10(255.0 * 255.0 / (sq_error / (double)samples));
+}
+
+void benchmark_print_cpr_result(const benchmark_result_t *res, uint64_t raw_size) {
+	double px = res->px;
+	printf("qoi_cpr:    lo      hi  weights          mul  eff  prt  ver  spc  ton  decode ms   encode ms   decode mpps   encode mpps   size kb    rate     psnr  maxerr\n");
+	for (int s = 0; s < cpr_settings_count; s++) {
+		const qoi_cpr_cfg *cfg = &cpr_settings[s];
+		benchmark_cpr_result_t c = res->cpr[s];
+		c.encode_time.avg /= res->count;
+		c.decode_time.avg /= res->count;
+		c.size /= res->count;
+		printf(
+			"        %6.2f  %6.1f  %3.0f/%3.0f/%3.0f/%3.0f  %3d  %3d  %3d  %3d  %3d  %3d   %8.1f    %8.1f      %8.2f      %8.2f  %8ld   %4.1f%%  %7.2f  %6d\n",
+			cfg->lothresh, cfg->hithresh,
+			cfg->weights[0] * 100, cfg->weights[1] * 100, cfg->weights[2] * 100, cfg->weights[3] * 100,
+			cfg->mulalpha, cfg->effort, cfg->protect, cfg->vertical, cfg->space, cfg->tone,
+			(double)c.decode_time.avg/1000000.0,
+			(double)c.encode_time.avg/1000000.0,
+			(c.decode_time.avg > 0 ? px / ((double)c.decode_time.avg/1000.0) : 0),
+			(c.encode_time.avg > 0 ? px / ((double)c.encode_time.avg/1000.0) : 0),
+			c.size/1024,
+			((double)c.size/(double)res->raw_size) * 100.0,
+			cpr_psnr(res->cpr[s].sq_error, raw_size),
+			c.max_error
+		);
+	}
+}
+
+// Print bits per pixel against PSNR for all qoi_cpr settings, sorted by size
+void benchmark_print_rdcurve(const benchmark_result_t *res) {
+	int order[CPR_SETTINGS_MAX];
+	for (int s = 0; s < cpr_settings_count; s++) {
+		int j = s;
+		while (j > 0 && res->cpr[order[j - 1]].size > res->cpr[s].size) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = s;
+	}
+
+	printf("     bpp     psnr  maxerr      lo      hi  weights          mul  eff  prt  ver  spc  ton\n");
+	for (int i = 0; i < cpr_settings_count; i++) {
+		const qoi_cpr_cfg *cfg = &cpr_settings[order[i]];
+		const benchmark_cpr_result_t *c = &res->cpr[order[i]];
+		printf(
+			"%8.3f  %7.2f  %6d  %6.2f  %6.1f  %3.0f/%3.0f/%3.0f/%3.0f  %3d  %3d  %3d  %3d  %3d  %3d\n",
+			(double)c->size * 8.0 / (double)res->px,
+			cpr_psnr(c->sq_error, res->raw_size),
+			c->max_error,
+			cfg->lothresh, cfg->hithresh,
+			cfg->weights[0] * 100, cfg->weights[1] * 100, cfg->weights[2] * 100, cfg->weights[3] * 100,
+			cfg->mulalpha, cfg->effort, cfg->protect, cfg->vertical, cfg->space, cfg->tone
+		);
+	}
+	printf("\n");
+}
+
+// -----------------------------------------------------------------------------
+// Flat list of all timed functions of a result, used for the timing table, the
+// JSON/CSV export and the baseline comparison
+
+typedef struct {
+	char codec[64];
+	const char *op;
+	uint64_t size;
+	const benchmark_time_t *time;
+} benchmark_entry_t;
+
+#define BENCHMARK_ENTRIES_MAX (6 + CPR_SETTINGS_MAX * 2)
+
+int benchmark_entries(const benchmark_result_t *res, benchmark_entry_t *entries) {
+	const char *lib_names[3] = {"libpng", "stbi", "qoi"};
+	const benchmark_lib_result_t *libs[3] = {&res->libpng, &res->stbi, &res->qoi};
+	int count = 0;
+
+	for (int l = opt_nopng ? 2 : 0; l < 3; l++) {
+		if (!opt_nodecode) {
+			snprintf(entries[count].codec, sizeof(entries[count].codec), "%s", lib_names[l]);
+			entries[count].op = "decode";
+			entries[count].size = libs[l]->size;
+			entries[count].time = &libs[l]->decode_time;
+			count++;
+		}
+		if (!opt_noencode) {
+			snprintf(entries[count].codec, sizeof(entries[count].codec), "%s", lib_names[l]);
+			entries[count].op = "encode";
+			entries[count].size = libs[l]->size;
+			entries[count].time = &libs[l]->encode_time;
+			count++;
+		}
+	}
+
+	if (opt_cpr) {
+		for (int s = 0; s < cpr_settings_count; s++) {
+			const qoi_cpr_cfg *cfg = &cpr_settings[s];
+			for (int op = 0; op < 2; op++) {
+				if ((op == 0 && opt_nodecode) || (op == 1 && opt_noencode)) {
+					continue;
+				}
+				cpr_name(entries[count].codec, sizeof(entries[count].codec), cfg);
+				entries[count].op = op == 0 ? "decode" : "encode";
+				entries[count].size = res->cpr[s].size;
+				entries[count].time = op == 0 ? &res->cpr[s].decode_time : &res->cpr[s].encode_time;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+// Hardware counters per pixel and per byte of the qoi/png data. res must hold
+// the sums over all images, as the counters do.
+void benchmark_print_perf(const benchmark_result_t *res) {
+	benchmark_entry_t entries[BENCHMARK_ENTRIES_MAX];
+	int count = benchmark_entries(res, entries);
+
+	printf(
+		"perf                                      "
+		"cyc/px  instr/px    IPC  brmiss/px  L1dmiss/px  LLCmiss/px     cyc/B  brmiss/B  L1dmiss/B  LLCmiss/B\n"
+	);
+	for (int e = 0; e < count; e++) {
+		const uint64_t *perf = entries[e].time->perf;
+		double px = res->px;
+		double bytes = entries[e].size ? entries[e].size : 1;
+		printf(
+			"%-36s %-6s %8.2f  %8.2f  %5.2f  %9.4f  %10.4f  %10.4f  %8.2f  %8.4f  %9.4f  %9.4f\n",
+			entries[e].codec, entries[e].op,
+			perf[PERF_CYCLES] / px,
+			perf[PERF_INSTRUCTIONS] / px,
+			perf[PERF_CYCLES] ? (double)perf[PERF_INSTRUCTIONS] / perf[PERF_CYCLES] : 0,
+			perf[PERF_BRANCH_MISSES] / px,
+			perf[PERF_L1D_MISSES] / px,
+			perf[PERF_LLC_MISSES] / px,
+			perf[PERF_CYCLES] / bytes,
+			perf[PERF_BRANCH_MISSES] / bytes,
+			perf[PERF_L1D_MISSES] / bytes,
+			perf[PERF_LLC_MISSES] / bytes
+		);
+	}
+}
+
+void benchmark_print_timing(const benchmark_result_t *res) {
+	benchmark_entry_t entries[BENCHMARK_ENTRIES_MAX];
+	int count = benchmark_entries(res, entries);
+
+	printf("timing ms                                        min      median         p90         p99      stddev\n");
+	for (int e = 0; e < count; e++) {
+		const benchmark_time_t *t = entries[e].time;
+		printf(
+			"%-36s %-6s  %10.3f  %10.3f  %10.3f  %10.3f  %10.3f\n",
+			entries[e].codec, entries[e].op,
+			(double)t->min/res->count/1000000.0,
+			(double)t->median/res->count/1000000.0,
+			(double)t->p90/res->count/1000000.0,
+			(double)t->p99/res->count/1000000.0,
+			sqrt(t->var)/res->count/1000000.0
+		);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// JSON/CSV export and baseline comparison
+// The JSON output has one record per line, so that --baseline can read it back
+// without a full JSON parser.
+
+FILE *opt_json_file = NULL;
+FILE *opt_csv_file = NULL;
+int json_record_count = 0;
+
+typedef struct {
+	char *key;
+	double median;
+	double stddev;
+	int runs;
+} baseline_record_t;
+
+baseline_record_t *baseline_records = NULL;
+int baseline_count = 0;
+int baseline_regressions = 0;
+
+// A regression must be larger than this fraction of the baseline median and
+// larger than BASELINE_SIGMAS standard errors of the difference of medians.
+#define BASELINE_MIN_CHANGE 0.02
+#define BASELINE_SIGMAS 3.0
+
+void json_write_string(FILE *fh, const char *str) {
+	fputc('"', fh);
+	for (; *str; str++) {
+		if ((unsigned char)*str < 0x20) {
+			fprintf(fh, "\\u%04x", (unsigned char)*str);
+			continue;
+		}
+		if (*str == '"' || *str == '\\') {
+			fputc('\\', fh);
+		}
+		fputc(*str, fh);
+	}
+	fputc('"', fh);
+}
+
+void csv_write_string(FILE *fh, const char *str) {
+	fputc('"', fh);
+	for (; *str; str++) {
+		if (*str == '"') {
+			fputc('"', fh);
+		}
+		fputc(*str, fh);
+	}
+	fputc('"', fh);
+}
+
+// Find "name": "value" in line and copy the unescaped value to out
+int json_read_string(const char *line, const char *name, char *out, int out_size) {
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\": \"", name);
+	const char *s = strstr(line, pattern);
+	if (!s) {
+		return 0;
+	}
+
+	int len = 0;
+	for (s += strlen(pattern); *s && *s != '"' && len < out_size - 1; s++) {
+		unsigned int c;
+		if (*s == '\\' && s[1] == 'u' && sscanf(s + 2, "%4x", &c) == 1) {
+			out[len++] = c;
+			s += 5;
+			continue;
+		}
+		if (*s == '\\' && s[1]) {
+			s++;
+		}
+		out[len++] = *s;
+	}
+	out[len] = '\0';
+	return *s == '"';
+}
+
+int json_read_number(const char *line, const char *name, double *out) {
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", name);
+	const char *s = strstr(line, pattern);
+	if (!s) {
+		return 0;
+	}
+	*out = strtod(s + strlen(pattern), NULL);
+	return 1;
+}
+
+char *baseline_key(const char *image, const char *codec, const char *op) {
+	char *key = malloc(strlen(image) + strlen(codec) + strlen(op) + 3);
+	sprintf(key, "%s|%s|%s", image, codec, op);
+	return key;
+}
+
+void baseline_load(const char *path) {
+	FILE *fh = fopen(path, "rb");
+	if (!fh) {
+		ERROR("Can't open baseline %s", path);
+	}
+
+	char line[2048];
+	int capacity = 0;
+	while (fgets(line, sizeof(line), fh)) {
+		char image[1024], codec[128], op[16];
+		double median, stddev, runs;
+		if (
+			!json_read_string(line, "image", image, sizeof(image)) ||
+			!json_read_string(line, "codec", codec, sizeof(codec)) ||
+			!json_read_string(line, "op", op, sizeof(op)) ||
+			!json_read_number(line, "median", &median) ||
+			!json_read_number(line, "stddev", &stddev) ||
+			!json_read_number(line, "runs", &runs)
+		) {
+			continue;
+		}
+
+		if (baseline_count == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			baseline_records = realloc(baseline_records, capacity * sizeof(baseline_record_t));
+		}
+		baseline_record_t *rec = &baseline_records[baseline_count++];
+		rec->key = baseline_key(image, codec, op);
+		rec->median = median;
+		rec->stddev = stddev;
+		rec->runs = runs;
+	}
+	fclose(fh);
+
+	if (baseline_count == 0) {
+		ERROR("No results found in baseline %s", path);
+	}
+}
+
+void baseline_compare(const char *name, const benchmark_entry_t *entry) {
+	char *key = baseline_key(name, entry->codec, entry->op);
+	const baseline_record_t *rec = NULL;
+	for (int i = 0; i < baseline_count; i++) {
+		if (strcmp(baseline_records[i].key, key) == 0) {
+			rec = &baseline_records[i];
+			break;
+		}
+	}
+	free(key);
+
+	if (!rec || rec->median <= 0) {
+		return;
+	}
+
+	const benchmark_time_t *t = entry->time;
+	double diff = (double)t->median - rec->median;
+	double std_error = sqrt(
+		rec->stddev * rec->stddev / rec->runs + 
+		t->var / (t->runs > 0 ? t->runs : 1)
+	);
+
+	if (diff > rec->median * BASELINE_MIN_CHANGE && diff > std_error * BASELINE_SIGMAS) {
+		baseline_regressions++;
+		printf(
+			"REGRESSION %s %s %s: median %.3f ms -> %.3f ms (+%.1f%%)\n",
+			name, entry->codec, entry->op,
+			rec->median/1000000.0, (double)t->median/1000000.0,
+			diff / rec->median * 100.0
+		);
+	}
+}
+
+// Write all timed functions of res to the JSON/CSV files and compare them to
+// the baseline.
+void benchmark_report(const char *name, const benchmark_result_t *res) {
+	benchmark_entry_t entries[BENCHMARK_ENTRIES_MAX];
+	int count = benchmark_entries(res, entries);
+
+	for (int e = 0; e < count; e++) {
+		const benchmark_time_t *t = entries[e].time;
+
+		if (opt_json_file) {
+			fprintf(opt_json_file, json_record_count++ ? ",\n\t\t{" : "\t\t{");
+			fprintf(opt_json_file, "\"image\": ");
+			json_write_string(opt_json_file, name);
+			fprintf(opt_json_file, ", \"codec\": ");
+			json_write_string(opt_json_file, entries[e].codec);
+			fprintf(
+				opt_json_file,
+				", \"op\": \"%s\", \"images\": %d, \"runs\": %d, \"px\": %lu, \"size\": %lu, "
+				"\"avg\": %lu, \"min\": %lu, \"median\": %lu, \"p90\": %lu, \"p99\": %lu, \"stddev\": %.1f}",
+				entries[e].op, res->count, t->runs, res->px, entries[e].size,
+				t->avg, t->min, t->median, t->p90, t->p99, sqrt(t->var)
+			);
+		}
+
+		if (opt_csv_file) {
+			csv_write_string(opt_csv_file, name);
+			fputc(',', opt_csv_file);
+			csv_write_string(opt_csv_file, entries[e].codec);
+			fprintf(
+				opt_csv_file, ",%s,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.1f\n",
+				entries[e].op, res->count, t->runs, res->px, entries[e].size,
+				t->avg, t->min, t->median, t->p90, t->p99, sqrt(t->var)
+			);
+		}
+
+		if (baseline_count) {
+			baseline_compare(name, &entries[e]);
+		}
+	}
+}
+
+void benchmark_print_result(const benchmark_result_t *total) {
+	benchmark_result_t res = *total;
+	uint64_t raw_size = res.raw_size;
 	res.px /= res.count;
 	res.raw_size /= res.count;
-	res.libpng.encode_time /= res.count;
-	res.libpng.decode_time /= res.count;
+	res.libpng.encode_time.avg /= res.count;
+	res.libpng.decode_time.avg /= res.count;
 	res.libpng.size /= res.count;
-	res.stbi.encode_time /= res.count;
-	res.stbi.decode_time /= res.count;
+	res.stbi.encode_time.avg /= res.count;
+	res.stbi.decode_time.avg /= res.count;
 	res.stbi.size /= res.count;
-	res.qoi.encode_time /= res.count;
-	res.qoi.decode_time /= res.count;
+	res.qoi.encode_time.avg /= res.count;
+	res.qoi.decode_time.avg /= res.count;
 	res.qoi.size /= res.count;
 
 	double px = res.px;
@@ -359,70 +1130,134 @@ void benchmark_print_result(benchmark_result_t res) {
 	if (!opt_nopng) {
 		printf(
 			"libpng:  %8.1f    %8.1f      %8.2f      %8.2f  %8ld   %4.1f%%\n", 
-			(double)res.libpng.decode_time/1000000.0, 
-			(double)res.libpng.encode_time/1000000.0, 
-			(res.libpng.decode_time > 0 ? px / ((double)res.libpng.decode_time/1000.0) : 0),
-			(res.libpng.encode_time > 0 ? px / ((double)res.libpng.encode_time/1000.0) : 0),
+			(double)res.libpng.decode_time.avg/1000000.0, 
+			(double)res.libpng.encode_time.avg/1000000.0, 
+			(res.libpng.decode_time.avg > 0 ? px / ((double)res.libpng.decode_time.avg/1000.0) : 0),
+			(res.libpng.encode_time.avg > 0 ? px / ((double)res.libpng.encode_time.avg/1000.0) : 0),
 			res.libpng.size/1024,
 			((double)res.libpng.size/(double)res.raw_size) * 100.0
 		);
 		printf(
 			"stbi:    %8.1f    %8.1f      %8.2f      %8.2f  %8ld   %4.1f%%\n", 
-			(double)res.stbi.decode_time/1000000.0,
-			(double)res.stbi.encode_time/1000000.0,
-			(res.stbi.decode_time > 0 ? px / ((double)res.stbi.decode_time/1000.0) : 0),
-			(res.stbi.encode_time > 0 ? px / ((double)res.stbi.encode_time/1000.0) : 0),
+			(double)res.stbi.decode_time.avg/1000000.0,
+			(double)res.stbi.encode_time.avg/1000000.0,
+			(res.stbi.decode_time.avg > 0 ? px / ((double)res.stbi.decode_time.avg/1000.0) : 0),
+			(res.stbi.encode_time.avg > 0 ? px / ((double)res.stbi.encode_time.avg/1000.0) : 0),
 			res.stbi.size/1024,
 			((double)res.stbi.size/(double)res.raw_size) * 100.0
 		);
 	}
 	printf(
 		"qoi:     %8.1f    %8.1f      %8.2f      %8.2f  %8ld   %4.1f%%\n", 
-		(double)res.qoi.decode_time/1000000.0,
-		(double)res.qoi.encode_time/1000000.0,
-		(res.qoi.decode_time > 0 ? px / ((double)res.qoi.decode_time/1000.0) : 0),
-		(res.qoi.encode_time > 0 ? px / ((double)res.qoi.encode_time/1000.0) : 0),
+		(double)res.qoi.decode_time.avg/1000000.0,
+		(double)res.qoi.encode_time.avg/1000000.0,
+		(res.qoi.decode_time.avg > 0 ? px / ((double)res.qoi.decode_time.avg/1000.0) : 0),
+		(res.qoi.encode_time.avg > 0 ? px / ((double)res.qoi.encode_time.avg/1000.0) : 0),
 		res.qoi.size/1024,
 		((double)res.qoi.size/(double)res.raw_size) * 100.0
 	);
+	if (opt_cpr) {
+		benchmark_print_cpr_result(&res, raw_size);
+	}
+	if (opt_timing) {
+		benchmark_print_timing(&res);
+	}
+	if (opt_perf) {
+		benchmark_print_perf(total);
+	}
+#ifdef QOI_STATS
+	if (opt_opstats) {
+		benchmark_print_opstats(&res);
+	}
+#endif
 	printf("\n");
 }
 
+int benchmark_compare_time(const void *a, const void *b) {
+	uint64_t ta = *(const uint64_t *)a;
+	uint64_t tb = *(const uint64_t *)b;
+	return ta < tb ? -1 : ta > tb;
+}
+
+// Compute the distribution of the samples of all runs
+void benchmark_time_stats(const uint64_t *run_samples, int runs, benchmark_time_t *time) {
+	uint64_t *samples = malloc(runs * sizeof(uint64_t));
+	memcpy(samples, run_samples, runs * sizeof(uint64_t));
+	qsort(samples, runs, sizeof(uint64_t), benchmark_compare_time);
+
+	uint64_t sum = 0;
+	for (int i = 0; i < runs; i++) {
+		sum += samples[i];
+	}
+	double mean = (double)sum / runs;
+	double sq_sum = 0;
+	for (int i = 0; i < runs; i++) {
+		sq_sum += ((double)samples[i] - mean) * ((double)samples[i] - mean);
+	}
+
+	time->avg = sum / runs;
+	time->min = samples[0];
+	time->median = runs % 2 ? samples[runs / 2] : (samples[runs / 2 - 1] + samples[runs / 2]) / 2;
+	time->p90 = samples[(runs * 90 + 99) / 100 - 1];
+	time->p99 = samples[(runs * 99 + 99) / 100 - 1];
+	time->var = runs > 1 ? sq_sum / (runs - 1) : 0;
+	time->runs = runs;
+	free(samples);
+}
+
+// Add the samples of time to total run by run and recompute its distribution.
+// Percentiles and the variance don't add up, so they are taken anew over the
+// summed samples.
+void benchmark_time_add(benchmark_time_t *total, const benchmark_time_t *time) {
+	if (!time->samples) {
+		return;
+	}
+	if (!total->samples) {
+		total->samples = calloc(time->runs, sizeof(uint64_t));
+	}
+	for (int i = 0; i < time->runs; i++) {
+		total->samples[i] += time->samples[i];
+	}
+	benchmark_time_stats(total->samples, time->runs, total);
+	for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+		total->perf[c] += time->perf[c];
+	}
+}
+
 // Run __VA_ARGS__ a number of times and measure the time taken. The first
-// run is ignored.
-#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, ...) \
+// run is ignored. With --perf the hardware counters are read around each run.
+#define BENCHMARK_FN(NOWARMUP, RUNS, TIME, ...) \
 	do { \
-		uint64_t time = 0; \
+		uint64_t *samples = malloc(RUNS * sizeof(uint64_t)); \
+		uint64_t perf_counts[PERF_COUNTER_COUNT] = {0}; \
 		for (int i = NOWARMUP; i <= RUNS; i++) { \
+			if (opt_perf && i > 0) { \
+				perf_start(); \
+			} \
 			uint64_t time_start = ns(); \
 			__VA_ARGS__ \
 			uint64_t time_end = ns(); \
+			if (opt_perf && i > 0) { \
+				perf_stop(perf_counts); \
+			} \
 			if (i > 0) { \
-				time += time_end - time_start; \
+				samples[i - 1] = time_end - time_start; \
 			} \
 		} \
-		AVG_TIME = time / RUNS; \
+		benchmark_time_stats(samples, RUNS, &(TIME)); \
+		(TIME).samples = samples; \
+		for (int c = 0; c < PERF_COUNTER_COUNT; c++) { \
+			(TIME).perf[c] = perf_counts[c] / RUNS; \
+		} \
 	} while (0)
 
 
-benchmark_result_t benchmark_image(const char *path) {
-	int encoded_png_size;
+// Benchmark all en-/decoders on the raw pixels. If encoded_png is NULL the 
+// png en-/decoders are skipped for this image.
+benchmark_result_t benchmark_pixels(const char *path, void *pixels, int w, int h, int channels, void *encoded_png, int encoded_png_size) {
 	int encoded_qoi_size;
-	int w;
-	int h;
-	int channels;
+	int nopng = opt_nopng || !encoded_png;
 
-	// Load the encoded PNG, encoded QOI and raw pixels into memory
-	if(!stbi_info(path, &w, &h, &channels)) {
-		ERROR("Error decoding header %s", path);
-	}
-
-	if (channels != 3) {
-		channels = 4;
-	}
-
-	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
-	void *encoded_png = fload(path, &encoded_png_size);
 	void *encoded_qoi = qoi_encode(pixels, &(qoi_desc){
 			.width = w,
 			.height = h, 
@@ -430,8 +1265,8 @@ benchmark_result_t benchmark_image(const char *path) {
 			.colorspace = QOI_SRGB
 		}, &encoded_qoi_size);
 
-	if (!pixels || !encoded_qoi || !encoded_png) {
-		ERROR("Error decoding %s", path);
+	if (!encoded_qoi) {
+		ERROR("Error encoding %s", path);
 	}
 
 	// Verify QOI Output
@@ -455,10 +1290,38 @@ benchmark_result_t benchmark_image(const char *path) {
 	res.h = h;
 
 
+	// Chunk statistics. The decoder must see the same chunks as the encoder
+	// has written.
+
+#ifdef QOI_STATS
+	if (opt_opstats) {
+		int enc_size;
+		void *enc_p = qoi_encode_stats(pixels, &(qoi_desc){
+			.width = w,
+			.height = h, 
+			.channels = channels,
+			.colorspace = QOI_SRGB
+		}, &enc_size, &res.qoi_stats);
+
+		qoi_stats dec_stats = {0};
+		qoi_desc dc;
+		void *dec_p = qoi_decode_stats(enc_p, enc_size, &dc, channels, &dec_stats);
+		if (
+			memcmp(res.qoi_stats.ops, dec_stats.ops, sizeof(dec_stats.ops)) != 0 ||
+			res.qoi_stats.index_hits != dec_stats.index_hits
+		) {
+			ERROR("QOI chunk statistics mismatch for %s", path);
+		}
+		free(enc_p);
+		free(dec_p);
+	}
+#endif
+
+
 	// Decoding
 
 	if (!opt_nodecode) {
-		if (!opt_nopng) {
+		if (!nopng) {
 			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libpng.decode_time, {
 				int dec_w, dec_h;
 				void *dec_p = libpng_decode(encoded_png, encoded_png_size, &dec_w, &dec_h);
@@ -482,7 +1345,7 @@ benchmark_result_t benchmark_image(const char *path) {
 
 	// Encoding
 	if (!opt_noencode) {
-		if (!opt_nopng) {
+		if (!nopng) {
 			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libpng.encode_time, {
 				int enc_size;
 				void *enc_p = libpng_encode(pixels, w, h, channels, &enc_size);
@@ -510,13 +1373,139 @@ benchmark_result_t benchmark_image(const char *path) {
 		});
 	}
 
+	// Lossy qoi_cpr sweep
+	if (opt_cpr) {
+		qoi_desc desc = {
+			.width = w,
+			.height = h, 
+			.channels = channels,
+			.colorspace = QOI_SRGB
+		};
+
+		for (int s = 0; s < cpr_settings_count; s++) {
+			const qoi_cpr_cfg *cfg = &cpr_settings[s];
+			benchmark_cpr_result_t *cres = &res.cpr[s];
+
+			int encoded_cpr_size;
+#ifdef QOI_STATS
+			void *encoded_cpr = qoi_cpr_encode_stats(pixels, &desc, cfg, &encoded_cpr_size, &res.cpr_stats[s]);
+#else
+			void *encoded_cpr = qoi_cpr_encode(pixels, &desc, cfg, &encoded_cpr_size);
+#endif
+			if (!encoded_cpr) {
+				ERROR("Error encoding qoi_cpr %s", path);
+			}
+			cres->size = encoded_cpr_size;
+
+			qoi_desc dc;
+			void *pixels_cpr = qoi_decode(encoded_cpr, encoded_cpr_size, &dc, channels);
+			if (!pixels_cpr) {
+				ERROR("Error decoding qoi_cpr output for %s", path);
+			}
+			cpr_measure_error(pixels, pixels_cpr, w * h, channels, cfg->mulalpha, &cres->sq_error, &cres->max_error);
+			free(pixels_cpr);
+
+			if (!opt_nodecode) {
+				BENCHMARK_FN(opt_nowarmup, opt_runs, cres->decode_time, {
+					qoi_desc desc;
+					void *dec_p = qoi_decode(encoded_cpr, encoded_cpr_size, &desc, 4);
+					free(dec_p);
+				});
+			}
+
+			if (!opt_noencode) {
+				BENCHMARK_FN(opt_nowarmup, opt_runs, cres->encode_time, {
+					int enc_size;
+					void *enc_p = qoi_cpr_encode(pixels, &desc, cfg, &enc_size);
+					free(enc_p);
+				});
+			}
+
+			free(encoded_cpr);
+		}
+	}
+
+	free(encoded_qoi);
+
+	return res;
+}
+
+benchmark_result_t benchmark_image(const char *path) {
+	int encoded_png_size;
+	int w;
+	int h;
+	int channels;
+
+	// Load the encoded PNG and raw pixels into memory
+	if(!stbi_info(path, &w, &h, &channels)) {
+		ERROR("Error decoding header %s", path);
+	}
+
+	if (channels != 3) {
+		channels = 4;
+	}
+
+	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
+	void *encoded_png = fload(path, &encoded_png_size);
+
+	if (!pixels || !encoded_png) {
+		ERROR("Error decoding %s", path);
+	}
+
+	benchmark_result_t res = benchmark_pixels(path, pixels, w, h, channels, encoded_png, encoded_png_size);
+
 	free(pixels);
 	free(encoded_png);
-	free(encoded_qoi);
 
 	return res;
 }
 
+void benchmark_lib_add(benchmark_lib_result_t *total, const benchmark_lib_result_t *res) {
+	benchmark_time_add(&total->encode_time, &res->encode_time);
+	benchmark_time_add(&total->decode_time, &res->decode_time);
+	total->size += res->size;
+}
+
+void benchmark_result_add(benchmark_result_t *total, const benchmark_result_t *res) {
+	total->count++;
+	total->raw_size += res->raw_size;
+	total->px += res->px;
+	benchmark_lib_add(&total->libpng, &res->libpng);
+	benchmark_lib_add(&total->stbi, &res->stbi);
+	benchmark_lib_add(&total->qoi, &res->qoi);
+
+	for (int s = 0; s < cpr_settings_count; s++) {
+		benchmark_time_add(&total->cpr[s].encode_time, &res->cpr[s].encode_time);
+		benchmark_time_add(&total->cpr[s].decode_time, &res->cpr[s].decode_time);
+		total->cpr[s].size += res->cpr[s].size;
+		total->cpr[s].sq_error += res->cpr[s].sq_error;
+		if (res->cpr[s].max_error > total->cpr[s].max_error) {
+			total->cpr[s].max_error = res->cpr[s].max_error;
+		}
+#ifdef QOI_STATS
+		qoi_stats_add(&total->cpr_stats[s], &res->cpr_stats[s]);
+#endif
+	}
+#ifdef QOI_STATS
+	qoi_stats_add(&total->qoi_stats, &res->qoi_stats);
+#endif
+}
+
+void benchmark_lib_free(benchmark_lib_result_t *res) {
+	free(res->encode_time.samples);
+	free(res->decode_time.samples);
+}
+
+void benchmark_result_free(benchmark_result_t *res) {
+	benchmark_lib_free(&res->libpng);
+	benchmark_lib_free(&res->stbi);
+	benchmark_lib_free(&res->qoi);
+	for (int s = 0; s < cpr_settings_count; s++) {
+		free(res->cpr[s].encode_time.samples);
+		free(res->cpr[s].decode_time.samples);
+	}
+}
+
 void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 	DIR *dir = opendir(path);
 	if (!dir) {
@@ -560,48 +1549,501 @@ void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 
 		if (!opt_onlytotals) {
 			printf("## %s size: %dx%d\n", file_path, res.w, res.h);
-			benchmark_print_result(res);
+			benchmark_print_result(&res);
 		}
+		benchmark_report(file_path, &res);
 
 		free(file_path);
 		
-		dir_total.count++;
-		dir_total.raw_size += res.raw_size;
-		dir_total.px += res.px;
-		dir_total.libpng.encode_time += res.libpng.encode_time;
-		dir_total.libpng.decode_time += res.libpng.decode_time;
-		dir_total.libpng.size += res.libpng.size;
-		dir_total.stbi.encode_time += res.stbi.encode_time;
-		dir_total.stbi.decode_time += res.stbi.decode_time;
-		dir_total.stbi.size += res.stbi.size;
-		dir_total.qoi.encode_time += res.qoi.encode_time;
-		dir_total.qoi.decode_time += res.qoi.decode_time;
-		dir_total.qoi.size += res.qoi.size;
-
-		grand_total->count++;
-		grand_total->raw_size += res.raw_size;
-		grand_total->px += res.px;
-		grand_total->libpng.encode_time += res.libpng.encode_time;
-		grand_total->libpng.decode_time += res.libpng.decode_time;
-		grand_total->libpng.size += res.libpng.size;
-		grand_total->stbi.encode_time += res.stbi.encode_time;
-		grand_total->stbi.decode_time += res.stbi.decode_time;
-		grand_total->stbi.size += res.stbi.size;
-		grand_total->qoi.encode_time += res.qoi.encode_time;
-		grand_total->qoi.decode_time += res.qoi.decode_time;
-		grand_total->qoi.size += res.qoi.size;
+		benchmark_result_add(&dir_total, &res);
+		benchmark_result_add(grand_total, &res);
+		benchmark_result_free(&res);
 	}
 	closedir(dir);
 
 	if (dir_total.count > 0) {
 		printf("## Total for %s\n", path);
-		benchmark_print_result(dir_total);
+		benchmark_print_result(&dir_total);
+
+		char total_name[1024];
+		snprintf(total_name, 1024, "%s/*.png", path);
+		benchmark_report(total_name, &dir_total);
+	}
+	benchmark_result_free(&dir_total);
+}
+
+
+// -----------------------------------------------------------------------------
+// synthetic corpus
+// With --synthetic qoibench generates images of several content categories in
+// memory instead of loading a directory of PNGs. Everything is derived from a
+// fixed hash, so runs are reproducible across machines. --synthetic-max adds a
+// size just below QOI_PIXELS_MAX to exercise the worst case buffer sizes; this
+// needs about 6 GB of RAM.
+
+// PNG en-/decoding is skipped for images larger than this
+#define SYNTHETIC_PNG_MAX_PX (16 * 1024 * 1024)
+
+typedef struct {
+	int w;
+	int h;
+} synthetic_size_t;
+
+static const synthetic_size_t synthetic_sizes[] = {
+	{16, 16}, {64, 64}, {512, 512}, {1920, 1080}, {4096, 4096}
+};
+static const synthetic_size_t synthetic_size_max = {20000, 19999};
+
+enum {
+	SYNTHETIC_FLAT_UI,
+	SYNTHETIC_GRADIENT,
+	SYNTHETIC_NOISE,
+	SYNTHETIC_PHOTO,
+	SYNTHETIC_SPARSE_ALPHA,
+	SYNTHETIC_TRANSPARENT,
+	SYNTHETIC_PALETTE,
+	SYNTHETIC_COUNT
+};
+
+static const char *synthetic_names[SYNTHETIC_COUNT] = {
+	"flat_ui", "gradient", "noise", "photo", "sparse_alpha", "transparent", "palette"
+};
+static const int synthetic_channels[SYNTHETIC_COUNT] = {3, 3, 4, 3, 4, 4, 3};
+
+int synthetic_size_count() {
+	return sizeof(synthetic_sizes) / sizeof(synthetic_sizes[0]) + opt_synthetic_max;
+}
+
+synthetic_size_t synthetic_size(int index) {
+	return index < (int)(sizeof(synthetic_sizes) / sizeof(synthetic_sizes[0]))
+		? synthetic_sizes[index]
+		: synthetic_size_max;
+}
+
+static inline uint32_t synthetic_hash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+void *synthetic_generate(int category, int w, int h, int channels) {
+	unsigned char *pixels = malloc((size_t)w * h * channels);
+	if (!pixels) {
+		ERROR("Malloc for %dx%d synthetic image failed", w, h);
+	}
+
+	uint32_t seed = synthetic_hash(category * 0x9e3779b9 + w * 31 + h);
+	int panel_w = w >= 8 ? w / 8 : 1;
+	int panel_h = h >= 12 ? h / 12 : 1;
+	int cell = w >= 64 ? 32 : 4;
+
+	// Smooth per row/column components for the photo-like category
+	float *wave_x = malloc(w * sizeof(float));
+	float *wave_y = malloc(h * sizeof(float));
+	for (int x = 0; x < w; x++) {
+		wave_x[x] = sinf(x * 6.2831853f / (w * 0.37f + 1)) * 50 + sinf(x * 6.2831853f / 23.f) * 8;
+	}
+	for (int y = 0; y < h; y++) {
+		wave_y[y] = cosf(y * 6.2831853f / (h * 0.53f + 1)) * 50 + sinf(y * 6.2831853f / 17.f) * 8;
+	}
+
+	unsigned char *p = pixels;
+	uint32_t noise = seed | 1;
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			unsigned char r = 0, g = 0, b = 0, a = 255;
+			uint32_t hash;
+
+			switch (category) {
+				case SYNTHETIC_FLAT_UI:
+					// Solid panels with one pixel borders
+					if (x % panel_w == 0 || y % panel_h == 0) {
+						r = g = b = 96;
+					}
+					else {
+						hash = synthetic_hash(seed + (x / panel_w) * 131 + (y / panel_h));
+						r = 160 + (hash & 0x3f);
+						g = 160 + ((hash >> 8) & 0x3f);
+						b = 160 + ((hash >> 16) & 0x3f);
+					}
+					break;
+				case SYNTHETIC_GRADIENT:
+					r = (int64_t)x * 255 / (w > 1 ? w - 1 : 1);
+					g = (int64_t)y * 255 / (h > 1 ? h - 1 : 1);
+					b = (int64_t)(x + y) * 255 / (w + h > 2 ? w + h - 2 : 1);
+					break;
+				case SYNTHETIC_NOISE:
+					noise ^= noise << 13;
+					noise ^= noise >> 17;
+					noise ^= noise << 5;
+					r = noise;
+					g = noise >> 8;
+					b = noise >> 16;
+					a = noise >> 24;
+					break;
+				case SYNTHETIC_PHOTO:
+					hash = synthetic_hash(seed + y * w + x);
+					r = QOI_CPR_CLAMP(128 + wave_x[x] + wave_y[y] * 0.5f + (int)(hash & 7) - 4, 0, 255);
+					g = QOI_CPR_CLAMP(112 + wave_x[x] * 0.7f + wave_y[y] + (int)((hash >> 8) & 7) - 4, 0, 255);
+					b = QOI_CPR_CLAMP(96 + wave_x[x] * 0.3f + wave_y[y] * 0.3f + (int)((hash >> 16) & 7) - 4, 0, 255);
+					break;
+				case SYNTHETIC_SPARSE_ALPHA:
+					// About 10% opaque sprites with a translucent outline
+					hash = synthetic_hash(seed + (x / cell) * 7919 + (y / cell));
+					if ((hash & 0xff) < 26) {
+						int edge = x % cell == 0 || y % cell == 0 || x % cell == cell - 1 || y % cell == cell - 1;
+						r = hash >> 8;
+						g = hash >> 16;
+						b = (x * 4) & 0xff;
+						a = edge ? 128 : 255;
+					}
+					else {
+						a = 0;
+					}
+					break;
+				case SYNTHETIC_TRANSPARENT:
+					a = 0;
+					break;
+				case SYNTHETIC_PALETTE:
+					// 16 colors in 4x4 blocks
+					hash = synthetic_hash(seed + synthetic_hash((x / 4) * 65537 + y / 4)) & 15;
+					hash = synthetic_hash(seed + hash);
+					r = hash;
+					g = hash >> 8;
+					b = hash >> 16;
+					break;
+			}
+
+			p[0] = r;
+			p[1] = g;
+			p[2] = b;
+			if (channels == 4) {
+				p[3] = a;
+			}
+			p += channels;
+		}
+	}
+
+	free(wave_x);
+	free(wave_y);
+	return pixels;
+}
+
+void benchmark_synthetic(benchmark_result_t *grand_total) {
+	for (int s = 0; s < synthetic_size_count(); s++) {
+		synthetic_size_t size = synthetic_size(s);
+		benchmark_result_t size_total = {0};
+
+		printf("## Benchmarking synthetic %dx%d -- %d runs\n\n", size.w, size.h, opt_runs);
+
+		for (int c = 0; c < SYNTHETIC_COUNT; c++) {
+			int channels = synthetic_channels[c];
+			void *pixels = synthetic_generate(c, size.w, size.h, channels);
+
+			void *encoded_png = NULL;
+			int encoded_png_size = 0;
+			if (!opt_nopng && size.w * size.h <= SYNTHETIC_PNG_MAX_PX) {
+				encoded_png = libpng_encode(pixels, size.w, size.h, channels, &encoded_png_size);
+			}
+
+			char name[64];
+			snprintf(name, sizeof(name), "synthetic/%s_%dx%d", synthetic_names[c], size.w, size.h);
+			benchmark_result_t res = benchmark_pixels(name, pixels, size.w, size.h, channels, encoded_png, encoded_png_size);
+
+			if (!opt_onlytotals) {
+				printf("## %s size: %dx%d\n", name, res.w, res.h);
+				benchmark_print_result(&res);
+			}
+			benchmark_report(name, &res);
+
+			free(pixels);
+			free(encoded_png);
+
+			benchmark_result_add(&size_total, &res);
+			benchmark_result_add(grand_total, &res);
+			benchmark_result_free(&res);
+		}
+
+		char total_name[64];
+		snprintf(total_name, sizeof(total_name), "synthetic/*_%dx%d", size.w, size.h);
+		printf("## Total for %s\n", total_name);
+		benchmark_print_result(&size_total);
+		benchmark_report(total_name, &size_total);
+		benchmark_result_free(&size_total);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// multi-threaded throughput benchmark
+// With --threads N the whole corpus is loaded into memory first. Then N threads
+// are started at the same time and each one en-/decodes the whole corpus
+// opt_runs times. This measures how the codec scales when the threads compete
+// for memory bandwidth and the allocator.
+
+typedef struct {
+	void *pixels;
+	void *encoded;
+	int encoded_size;
+	int w;
+	int h;
+	int channels;
+} threads_image_t;
+
+typedef struct {
+	threads_image_t *images;
+	int count;
+	int capacity;
+	uint64_t px;
+} threads_corpus_t;
+
+enum {
+	THREADS_QOI_DECODE,
+	THREADS_QOI_ENCODE,
+	THREADS_CPR_ENCODE,
+	THREADS_OP_COUNT
+};
+
+static const char *threads_op_names[THREADS_OP_COUNT] = {
+	"qoi decode",
+	"qoi encode",
+	"qoi_cpr encode"
+};
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int go;
+} threads_gate_t;
+
+typedef struct {
+	pthread_t thread;
+	threads_corpus_t *corpus;
+	threads_gate_t *gate;
+	int op;
+	uint64_t time;
+} threads_worker_t;
+
+// Add the pixels to the corpus; the corpus takes ownership of them
+void threads_add_image(threads_corpus_t *corpus, void *pixels, int w, int h, int channels) {
+	if (corpus->count == corpus->capacity) {
+		corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 64;
+		corpus->images = realloc(corpus->images, corpus->capacity * sizeof(threads_image_t));
+	}
+
+	threads_image_t *image = &corpus->images[corpus->count++];
+	image->pixels = pixels;
+	image->w = w;
+	image->h = h;
+	image->channels = channels;
+	image->encoded = qoi_encode(image->pixels, &(qoi_desc){
+			.width = w,
+			.height = h, 
+			.channels = channels,
+			.colorspace = QOI_SRGB
+		}, &image->encoded_size);
+
+	if (!image->encoded) {
+		ERROR("Error encoding image %d", corpus->count);
+	}
+	corpus->px += w * h;
+}
+
+void threads_collect_synthetic(threads_corpus_t *corpus) {
+	for (int s = 0; s < synthetic_size_count(); s++) {
+		synthetic_size_t size = synthetic_size(s);
+		for (int c = 0; c < SYNTHETIC_COUNT; c++) {
+			void *pixels = synthetic_generate(c, size.w, size.h, synthetic_channels[c]);
+			threads_add_image(corpus, pixels, size.w, size.h, synthetic_channels[c]);
+		}
+	}
+}
+
+void threads_collect_directory(const char *path, threads_corpus_t *corpus) {
+	DIR *dir = opendir(path);
+	if (!dir) {
+		ERROR("Couldn't open directory %s", path);
+	}
+
+	struct dirent *file;
+	while ((file = readdir(dir)) != NULL) {
+		char *file_path = malloc(strlen(file->d_name) + strlen(path)+8);
+		sprintf(file_path, "%s/%s", path, file->d_name);
+
+		if (
+			file->d_type & DT_DIR &&
+			strcmp(file->d_name, ".") != 0 &&
+			strcmp(file->d_name, "..") != 0
+		) {
+			if (!opt_norecurse) {
+				threads_collect_directory(file_path, corpus);
+			}
+		}
+		else if (strcmp(file->d_name + strlen(file->d_name) - 4, ".png") == 0) {
+			int w, h, channels;
+			if(!stbi_info(file_path, &w, &h, &channels)) {
+				ERROR("Error decoding header %s", file_path);
+			}
+
+			if (channels != 3) {
+				channels = 4;
+			}
+
+			void *pixels = (void *)stbi_load(file_path, &w, &h, NULL, channels);
+			if (!pixels) {
+				ERROR("Error decoding %s", file_path);
+			}
+			threads_add_image(corpus, pixels, w, h, channels);
+		}
+		free(file_path);
 	}
+	closedir(dir);
+}
+
+void *threads_worker(void *arg) {
+	threads_worker_t *worker = (threads_worker_t *)arg;
+	threads_corpus_t *corpus = worker->corpus;
+
+	pthread_mutex_lock(&worker->gate->mutex);
+	while (!worker->gate->go) {
+		pthread_cond_wait(&worker->gate->cond, &worker->gate->mutex);
+	}
+	pthread_mutex_unlock(&worker->gate->mutex);
+
+	uint64_t time_start = ns();
+	for (int run = 0; run < opt_runs; run++) {
+		for (int i = 0; i < corpus->count; i++) {
+			threads_image_t *image = &corpus->images[i];
+			qoi_desc desc = {
+				.width = image->w,
+				.height = image->h,
+				.channels = image->channels,
+				.colorspace = QOI_SRGB
+			};
+			void *out = NULL;
+			int out_size;
+
+			if (worker->op == THREADS_QOI_DECODE) {
+				out = qoi_decode(image->encoded, image->encoded_size, &desc, 4);
+			}
+			else if (worker->op == THREADS_QOI_ENCODE) {
+				out = qoi_encode(image->pixels, &desc, &out_size);
+			}
+			else {
+				out = qoi_cpr_encode(image->pixels, &desc, &cpr_settings[0], &out_size);
+			}
+
+			if (!out) {
+				ERROR("%s failed in worker thread", threads_op_names[worker->op]);
+			}
+			free(out);
+		}
+	}
+	worker->time = ns() - time_start;
+	return NULL;
+}
+
+// Run op on num_threads threads at the same time. Returns the wall time and
+// the sum of all per-thread times.
+uint64_t threads_run(threads_corpus_t *corpus, int num_threads, int op, uint64_t *thread_time_sum) {
+	threads_gate_t gate = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.go = 0
+	};
+	threads_worker_t *workers = calloc(num_threads, sizeof(threads_worker_t));
+
+	for (int t = 0; t < num_threads; t++) {
+		workers[t].corpus = corpus;
+		workers[t].gate = &gate;
+		workers[t].op = op;
+		if (pthread_create(&workers[t].thread, NULL, threads_worker, &workers[t]) != 0) {
+			ERROR("Couldn't create thread %d", t);
+		}
+	}
+
+	pthread_mutex_lock(&gate.mutex);
+	uint64_t time_start = ns();
+	gate.go = 1;
+	pthread_cond_broadcast(&gate.cond);
+	pthread_mutex_unlock(&gate.mutex);
+
+	*thread_time_sum = 0;
+	for (int t = 0; t < num_threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		*thread_time_sum += workers[t].time;
+	}
+	uint64_t wall_time = ns() - time_start;
+
+	free(workers);
+	return wall_time;
+}
+
+void threads_benchmark(const char *path) {
+	threads_corpus_t corpus = {0};
+	if (opt_synthetic) {
+		threads_collect_synthetic(&corpus);
+	}
+	else {
+		threads_collect_directory(path, &corpus);
+	}
+
+	if (corpus.count == 0) {
+		printf("No images found in %s\n", path);
+		return;
+	}
+
+	printf(
+		"## Throughput for %s -- %d images, %d runs, %d threads\n\n",
+		opt_synthetic ? "synthetic/*" : path, corpus.count, opt_runs, opt_threads
+	);
+	printf("                  1-thread mpps   aggregate mpps   per-thread mpps   scaling\n");
+
+	double px = (double)corpus.px * opt_runs;
+	for (int op = 0; op < THREADS_OP_COUNT; op++) {
+		if (
+			(op == THREADS_QOI_DECODE && opt_nodecode) ||
+			(op != THREADS_QOI_DECODE && opt_noencode) ||
+			(op == THREADS_CPR_ENCODE && !opt_cpr)
+		) {
+			continue;
+		}
+
+		uint64_t thread_time_sum;
+		if (!opt_nowarmup) {
+			threads_run(&corpus, 1, op, &thread_time_sum);
+		}
+
+		uint64_t single_time = threads_run(&corpus, 1, op, &thread_time_sum);
+		uint64_t multi_time = threads_run(&corpus, opt_threads, op, &thread_time_sum);
+
+		double single_mpps = px / ((double)single_time/1000.0);
+		double aggregate_mpps = px * opt_threads / ((double)multi_time/1000.0);
+		double thread_mpps = px * opt_threads / ((double)thread_time_sum/1000.0);
+		printf(
+			"%-16s  %13.2f    %13.2f     %13.2f   %6.1f%%\n",
+			threads_op_names[op],
+			single_mpps,
+			aggregate_mpps,
+			thread_mpps,
+			aggregate_mpps / (single_mpps * opt_threads) * 100.0
+		);
+	}
+	printf("\n");
+
+	for (int i = 0; i < corpus.count; i++) {
+		free(corpus.images[i].pixels);
+		free(corpus.images[i].encoded);
+	}
+	free(corpus.images);
 }
 
 int main(int argc, char **argv) {
 	if (argc < 3) {
-		printf("Usage: qoibench <iterations> <directory> [options]\n");
+		printf("Usage: qoibench <iterations> <directory|--synthetic> [options]\n");
 		printf("Options:\n");
 		printf("    --nowarmup ... don't perform a warmup run\n");
 		printf("    --nopng ...... don't run png encode/decode\n");
@@ -610,12 +2052,42 @@ int main(int argc, char **argv) {
 		printf("    --nodecode ... don't run decoders\n");
 		printf("    --norecurse .. don't descend into directories\n");
 		printf("    --onlytotals . don't print individual image results\n");
+		printf("    --cpr ........ benchmark qoi_cpr over a grid of settings\n");
+		printf("    --cpr-lo l,... low contrast thresholds to sweep (default 0.6,2)\n");
+		printf("    --cpr-hi h,... high contrast thresholds to sweep (default 48,96,160)\n");
+		printf("    --cpr-w r:g:b:a,... channel weights in percentage to sweep (default 60:100:40:100)\n");
+		printf("    --cpr-mul m,.. multiply alpha modes to sweep (default 0,1)\n");
+		printf("    --cpr-effort e,... encoder efforts to sweep, 1 fast - 4 trellis (default 0)\n");
+		printf("    --cpr-protect p,.. index slot protection modes to sweep (default 0)\n");
+		printf("    --cpr-vertical v,. vertical contrast modes to sweep (default 0)\n");
+		printf("    --cpr-space s,... error spaces to sweep, 0 rgb, 1 ycocg (default 0)\n");
+		printf("    --cpr-tone t,. lightness aware threshold modes to sweep (default 0)\n");
+		printf("    --rdcurve .... print the qoi_cpr rate-distortion curve of the grand total\n");
+		printf("    --threads n .. measure en-/decode throughput of the corpus on n threads\n");
+		printf("    --synthetic-max  add %ux%u synthetic images (needs ~6 GB RAM)\n", synthetic_size_max.w, synthetic_size_max.h);
+		printf("    --timing ..... print min, median, p90, p99 and stddev of all timings\n");
+		printf("    --perf ....... count cycles, instructions, branch and cache misses (Linux)\n");
+#ifdef QOI_STATS
+		printf("    --opstats .... print chunk statistics of qoi and qoi_cpr\n");
+#endif
+		printf("    --json file .. write all timings as JSON to file\n");
+		printf("    --csv file ... write all timings as CSV to file\n");
+		printf("    --baseline file.json  flag significant regressions against a --json output\n");
 		printf("Examples\n");
 		printf("    qoibench 10 images/textures/\n");
 		printf("    qoibench 1 images/textures/ --nopng --nowarmup\n");
+		printf("    qoibench 3 images/photos/ --nopng --cpr --cpr-lo 0.6,1,2,4 --cpr-mul 0 --rdcurve\n");
+		printf("    qoibench 5 images/ --threads 32\n");
+		printf("    qoibench 3 --synthetic --nopng --cpr\n");
+		printf("    qoibench 20 images/ --json new.json --baseline old.json\n");
 		exit(1);
 	}
 
+	opt_synthetic = strcmp(argv[2], "--synthetic") == 0;
+	const char *json_path = NULL;
+	const char *csv_path = NULL;
+	const char *baseline_path = NULL;
+
 	for (int i = 3; i < argc; i++) {
 		if (strcmp(argv[i], "--nowarmup") == 0) { opt_nowarmup = 1; }
 		else if (strcmp(argv[i], "--nopng") == 0) { opt_nopng = 1; }
@@ -624,24 +2096,138 @@ int main(int argc, char **argv) {
 		else if (strcmp(argv[i], "--nodecode") == 0) { opt_nodecode = 1; }
 		else if (strcmp(argv[i], "--norecurse") == 0) { opt_norecurse = 1; }
 		else if (strcmp(argv[i], "--onlytotals") == 0) { opt_onlytotals = 1; }
+		else if (strcmp(argv[i], "--cpr") == 0) { opt_cpr = 1; }
+		else if (strcmp(argv[i], "--rdcurve") == 0) { opt_cpr = 1; opt_rdcurve = 1; }
+		else if (strcmp(argv[i], "--cpr-lo") == 0 && i + 1 < argc) {
+			cpr_grid_lo_count = parse_float_list(argv[++i], cpr_grid_lo, CPR_GRID_MAX);
+		}
+		else if (strcmp(argv[i], "--cpr-hi") == 0 && i + 1 < argc) {
+			cpr_grid_hi_count = parse_float_list(argv[++i], cpr_grid_hi, CPR_GRID_MAX);
+		}
+		else if (strcmp(argv[i], "--cpr-w") == 0 && i + 1 < argc) {
+			int count = parse_float_list(argv[++i], cpr_grid_weights, CPR_GRID_MAX * 4);
+			if (count % 4 != 0) {
+				ERROR("Weights need 4 values each, got %d", count);
+			}
+			for (int c = 0; c < count; c++) {
+				cpr_grid_weights[c] /= 100.f;
+			}
+			cpr_grid_weights_count = count / 4;
+		}
+		else if (strcmp(argv[i], "--cpr-mul") == 0 && i + 1 < argc) {
+			cpr_grid_mulalpha_count = parse_int_list(argv[++i], cpr_grid_mulalpha, 2);
+		}
+		else if (strcmp(argv[i], "--cpr-effort") == 0 && i + 1 < argc) {
+			cpr_grid_effort_count = parse_int_list(argv[++i], cpr_grid_effort, CPR_GRID_MAX);
+		}
+		else if (strcmp(argv[i], "--cpr-protect") == 0 && i + 1 < argc) {
+			cpr_grid_protect_count = parse_int_list(argv[++i], cpr_grid_protect, 2);
+		}
+		else if (strcmp(argv[i], "--cpr-vertical") == 0 && i + 1 < argc) {
+			cpr_grid_vertical_count = parse_int_list(argv[++i], cpr_grid_vertical, 2);
+		}
+		else if (strcmp(argv[i], "--cpr-space") == 0 && i + 1 < argc) {
+			cpr_grid_space_count = parse_int_list(argv[++i], cpr_grid_space, 2);
+		}
+		else if (strcmp(argv[i], "--cpr-tone") == 0 && i + 1 < argc) {
+			cpr_grid_tone_count = parse_int_list(argv[++i], cpr_grid_tone, 2);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			opt_threads = atoi(argv[++i]);
+			if (opt_threads <= 0) {
+				ERROR("Invalid number of threads %d", opt_threads);
+			}
+		}
+		else if (strcmp(argv[i], "--timing") == 0) { opt_timing = 1; }
+		else if (strcmp(argv[i], "--synthetic-max") == 0) { opt_synthetic_max = 1; }
+		else if (strcmp(argv[i], "--perf") == 0) { opt_perf = 1; }
+#ifdef QOI_STATS
+		else if (strcmp(argv[i], "--opstats") == 0) { opt_opstats = 1; }
+#endif
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) { json_path = argv[++i]; }
+		else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) { csv_path = argv[++i]; }
+		else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) { baseline_path = argv[++i]; }
 		else { ERROR("Unknown option %s", argv[i]); }
 	}
 
+	// The throughput mode has no per image timings to export or compare
+	if (opt_threads && (json_path || csv_path || baseline_path)) {
+		ERROR("--json, --csv and --baseline can't be used with --threads");
+	}
+	if (opt_threads && opt_perf) {
+		ERROR("--perf can't be used with --threads");
+	}
+	if (json_path && !(opt_json_file = fopen(json_path, "wb"))) {
+		ERROR("Can't open %s", json_path);
+	}
+	if (csv_path && !(opt_csv_file = fopen(csv_path, "wb"))) {
+		ERROR("Can't open %s", csv_path);
+	}
+	if (baseline_path) {
+		baseline_load(baseline_path);
+	}
+
+	cpr_build_settings();
+
+	if (opt_perf) {
+		perf_init();
+	}
+
 	opt_runs = atoi(argv[1]);
 	if (opt_runs <=0) {
 		ERROR("Invalid number of runs %d", opt_runs);
 	}
 
+	if (opt_threads) {
+		threads_benchmark(argv[2]);
+		return 0;
+	}
+
+	if (opt_json_file) {
+		fprintf(opt_json_file, "{\n\t\"runs\": %d,\n\t\"results\": [\n", opt_runs);
+	}
+	if (opt_csv_file) {
+		fprintf(opt_csv_file, "image,codec,op,images,runs,px,size,avg_ns,min_ns,median_ns,p90_ns,p99_ns,stddev_ns\n");
+	}
+
 	benchmark_result_t grand_total = {0};
-	benchmark_directory(argv[2], &grand_total);
+	if (opt_synthetic) {
+		benchmark_synthetic(&grand_total);
+	}
+	else {
+		benchmark_directory(argv[2], &grand_total);
+	}
 
 	if (grand_total.count > 0) {
-		printf("# Grand total for %s\n", argv[2]);
-		benchmark_print_result(grand_total);
+		printf("# Grand total for %s\n", opt_synthetic ? "synthetic/**" : argv[2]);
+		benchmark_print_result(&grand_total);
+
+		char total_name[1024];
+		snprintf(total_name, 1024, opt_synthetic ? "synthetic/**" : "%s/**.png", argv[2]);
+		benchmark_report(total_name, &grand_total);
+
+		if (opt_rdcurve) {
+			printf("# Rate-distortion curve for %s\n", opt_synthetic ? "synthetic/**" : argv[2]);
+			benchmark_print_rdcurve(&grand_total);
+		}
 	}
 	else {
 		printf("No images found in %s\n", argv[2]);
 	}
+	benchmark_result_free(&grand_total);
+
+	if (opt_json_file) {
+		fprintf(opt_json_file, "\n\t]\n}\n");
+		fclose(opt_json_file);
+	}
+	if (opt_csv_file) {
+		fclose(opt_csv_file);
+	}
+
+	if (baseline_count) {
+		printf("# %d significant regressions against the baseline\n", baseline_regressions);
+		return baseline_regressions ? 1 : 0;
+	}
 
 	return 0;
 }
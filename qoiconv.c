@@ -1,6 +1,7 @@
 /*
 
-Command line tool to convert between png <> qoi format
+Command line tool to convert between png <> qoi format, also reads raw
+pixels from ppm/pam/raw files
 
 Requires "stb_image.h" and "stb_image_write.h"
 Compile with: 
@@ -32,6 +33,12 @@ SOFTWARE.
 */
 
 
+/* mmap for the raw inputs */
+#if defined(__unix__) || defined(__APPLE__)
+	#define _GNU_SOURCE
+	#define PNM_MMAP
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #define STBI_NO_LINEAR
@@ -43,21 +50,45 @@ SOFTWARE.
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
 
+#include "qoiconv_pnm.h"
+
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
+
 int main(int argc, char **argv) {
 	if (argc < 3) {
-		puts("Usage: qoiconv <infile> <outfile>");
+		puts("Usage: qoiconv <infile> <outfile> [-raw <width> <height> <channels>]");
+		puts("Inputs: png, qoi, binary ppm/pam (8 bit RGB/RGBA), raw RGB/RGBA with -raw");
 		puts("Examples:");
 		puts("  qoiconv input.png output.qoi");
 		puts("  qoiconv input.qoi output.png");
+		puts("  qoiconv frame.raw output.qoi -raw 1920 1080 4");
 		exit(1);
 	}
 
+	int raw_w = 0, raw_h = 0, raw_channels = 0;
+	if (argc > 3) {
+		if (argc != 7 || strcmp(argv[3], "-raw") != 0) {
+			printf("Unknown options, see qoiconv without arguments\n");
+			exit(1);
+		}
+		raw_w = atoi(argv[4]);
+		raw_h = atoi(argv[5]);
+		raw_channels = atoi(argv[6]);
+		if (raw_w <= 0 || raw_h <= 0 || raw_channels < 3 || raw_channels > 4) {
+			printf("Invalid -raw size %s %s %s\n", argv[4], argv[5], argv[6]);
+			exit(1);
+		}
+	}
+
 	void *pixels = NULL;
 	int w, h, channels;
-	if (STR_ENDS_WITH(argv[1], ".png")) {
+	pnm_file raw_file = {0};
+	if (raw_w > 0 || STR_ENDS_WITH(argv[1], ".ppm") || STR_ENDS_WITH(argv[1], ".pam")) {
+		pixels = pnm_load(argv[1], raw_w, raw_h, raw_channels, &w, &h, &channels, &raw_file);
+	}
+	else if (STR_ENDS_WITH(argv[1], ".png")) {
 		if(!stbi_info(argv[1], &w, &h, &channels)) {
 			printf("Couldn't read header %s\n", argv[1]);
 			exit(1);
@@ -101,6 +132,11 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
-	free(pixels);
+	if (raw_file.data) {
+		pnm_close(&raw_file);
+	}
+	else {
+		free(pixels);
+	}
 	return 0;
 }
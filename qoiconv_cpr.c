@@ -6,6 +6,8 @@ The png > qoi conversion is Lossy
 Requires "stb_image.h" and "stb_image_write.h"
 Compile with: 
 	gcc qoiconv_cpr.c -std=c99 -O3 -o qoiconv_cpr
+On Linux, add -lpthread for the -serve mode. Add -DQOI_STATS to have -v print
+the chunk statistics of the en-/decoder.
 
 Dominic Szablewski - https://phoboslab.org
 Chen J.C.
@@ -34,6 +36,17 @@ SOFTWARE.
 */
 
 
+/* POSIX file handling and mmap for -cache and raw inputs, memfd_create and
+SCM_RIGHTS for -serve and -c */
+#if defined(__unix__) || defined(__APPLE__)
+	#define _GNU_SOURCE
+	#define CONV_CACHE
+	#define PNM_MMAP
+#endif
+#ifdef __linux__
+	#define CONV_SERVE
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #define STBI_ONLY_JPEG
@@ -46,18 +59,817 @@ SOFTWARE.
 #define QOI_IMPLEMENTATION
 #include "qoi_cpr.h"
 
+#include "qoiconv_pnm.h"
+
+#ifdef CONV_CACHE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#ifdef CONV_SERVE
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <time.h>
+#endif
+
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
+#ifdef QOI_STATS
+void print_stats(const char *what, const qoi_stats *stats, int px) {
+	const char *op_names[QOI_STATS_OP_COUNT] = {"run", "index", "diff", "luma", "rgb", "rgba"};
+	unsigned long long bytes = 0;
+	for (int op = 0; op < QOI_STATS_OP_COUNT; op++) {
+		bytes += stats->op_bytes[op];
+	}
+
+	printf("%s %d pixels, %llu bytes of chunks\n", what, px, bytes);
+	for (int op = 0; op < QOI_STATS_OP_COUNT; op++) {
+		printf(
+			"  %-6s %10llu chunks %10llu bytes (%5.1f%%)\n", 
+			op_names[op], stats->ops[op], stats->op_bytes[op],
+			bytes ? (double)stats->op_bytes[op] / bytes * 100.0 : 0
+		);
+	}
+	printf(
+		"  index hits %llu of %llu (%.1f%%)\n", 
+		stats->index_hits, stats->index_lookups,
+		stats->index_lookups ? (double)stats->index_hits / stats->index_lookups * 100.0 : 0
+	);
+	if (stats->cpr_scan_hits + stats->cpr_scan_misses) {
+		printf(
+			"  index scan hits %llu, misses %llu, compare_color calls %llu (%.2f per pixel)\n", 
+			stats->cpr_scan_hits, stats->cpr_scan_misses, stats->cpr_compares,
+			(double)stats->cpr_compares / px
+		);
+	}
+}
+#endif
+
+
+#ifdef CONV_CACHE
+
+/* Encode cache: -cache <dir> stores every encoded .qoi in dir under a hash
+of everything that determines it (pixels, size, channels, colorspace and
+the whole config including the -map values). An identical conversion then
+copies the stored file instead of encoding.
+
+The key is a single 64 bit non-cryptographic hash and a hit is only checked
+against the image size, so two different inputs with the same key would get
+the same file. By chance that takes ~2^32 entries; inputs crafted to collide
+are not guarded against, so don't share a cache dir with untrusted users.
+
+dir/stats holds the hits and misses over all runs and the total size of the
+entries. Stores add to that total, and only once it passes -cache-max is the
+dir scanned and the least recently used entries (their mtime is touched on
+every hit) evicted, down to CONV_CACHE_LOW of the limit so the next scan is
+some stores away. The scan also corrects the total for entries that
+concurrent runs stored twice or that were deleted by hand. */
+
+/* Bump when the encoder's output changes for the same settings */
+#define CONV_CACHE_VERSION 1ull
+
+/* Build options that change the file written for the same pixels and
+settings; part of the key so builds with and without them can share a dir */
+#ifdef QOI_CRC
+	#define CONV_BUILD_FLAGS 1
+#else
+	#define CONV_BUILD_FLAGS 0
+#endif
+
+/* Fraction of -cache-max that an eviction leaves */
+#define CONV_CACHE_LOW 0.9
+
+#define CONV_P1 0x9e3779b185ebca87ull
+#define CONV_P2 0xc2b2ae3d27d4eb4full
+#define CONV_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* 64 bit hash over 4 independent lanes of 8 bytes, ~1 byte per cycle */
+static unsigned long long conv_hash(unsigned long long seed, const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned long long lane[4] = {seed + CONV_P1 + CONV_P2, seed + CONV_P2, seed, seed - CONV_P1};
+	unsigned long long h, v;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			memcpy(&v, p + i + l * 8, 8);
+			lane[l] = CONV_ROTL(lane[l] + v * CONV_P2, 31) * CONV_P1;
+		}
+	}
+	h = CONV_ROTL(lane[0], 1) + CONV_ROTL(lane[1], 7) + CONV_ROTL(lane[2], 12) + CONV_ROTL(lane[3], 18);
+	h += len;
+	for (; i < len; i++) {
+		h = CONV_ROTL(h ^ (p[i] * CONV_P1), 23) * CONV_P2;
+	}
+	h ^= h >> 33;
+	h *= CONV_P2;
+	h ^= h >> 29;
+	return h;
+}
+
+static unsigned long long conv_cache_key(const void *pixels, const qoi_desc *desc, const qoi_cpr_cfg *cfg, int map_len) {
+	const float fkey[6] = {
+		cfg->weights[0], cfg->weights[1], cfg->weights[2], cfg->weights[3],
+		cfg->lothresh, cfg->hithresh
+	};
+	const int ikey[12] = {
+		(int)desc->width, (int)desc->height, desc->channels, desc->colorspace,
+		cfg->mulalpha, cfg->effort, cfg->protect, cfg->vertical, cfg->space,
+		cfg->tone, cfg->map ? cfg->map_block : 0, CONV_BUILD_FLAGS
+	};
+	unsigned long long h = conv_hash(CONV_CACHE_VERSION, pixels, (size_t)desc->width * desc->height * desc->channels);
+	h = conv_hash(h, fkey, sizeof(fkey));
+	h = conv_hash(h, ikey, sizeof(ikey));
+	if (cfg->map) {
+		h = conv_hash(h, cfg->map, map_len * sizeof(float));
+	}
+	return h;
+}
+
+static void *conv_read_file(const char *path, int *size) {
+	FILE *f = fopen(path, "rb");
+	void *data = NULL;
+	long len;
+
+	if (!f) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len > 0 && len < 0x7fffffff && (data = malloc(len))) {
+		if (fread(data, 1, len, f) != (size_t)len) {
+			free(data);
+			data = NULL;
+		}
+		*size = (int)len;
+	}
+	fclose(f);
+	return data;
+}
+
+/* Copy the entry at path to outfile if it's an intact image of this size */
+static int conv_cache_get(const char *path, const char *outfile, const qoi_desc *desc) {
+	qoi_desc cached;
+	int size = 0, ok = 0;
+	void *data = conv_read_file(path, &size);
+
+	if (
+		data && qoi_validate(data, size, &cached) &&
+		cached.width == desc->width && cached.height == desc->height &&
+		cached.channels == desc->channels && cached.colorspace == desc->colorspace
+	) {
+		FILE *f = fopen(outfile, "wb");
+		if (f) {
+			ok = fwrite(data, 1, size, f) == (size_t)size;
+			fclose(f);
+		}
+		utime(path, NULL);
+	}
+	free(data);
+	return ok;
+}
+
+typedef struct {
+	char name[32];
+	long long size;
+	time_t mtime;
+} conv_cache_entry;
+
+static int conv_cache_older(const void *a, const void *b) {
+	time_t ta = ((const conv_cache_entry *)a)->mtime, tb = ((const conv_cache_entry *)b)->mtime;
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* Delete the least recently used entries until dir holds at most max_bytes;
+returns the size of the remaining entries */
+static long long conv_cache_evict(const char *dir, long long max_bytes) {
+	DIR *d = opendir(dir);
+	conv_cache_entry *entries = NULL;
+	int count = 0, capacity = 0;
+	long long total = 0;
+	struct dirent *de;
+	char path[4096];
+
+	if (!d) {
+		return 0;
+	}
+	while ((de = readdir(d))) {
+		struct stat st;
+		if (strlen(de->d_name) != 20 || !STR_ENDS_WITH(de->d_name, ".qoi")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		if (count == capacity) {
+			conv_cache_entry *grown;
+			capacity = capacity ? capacity * 2 : 256;
+			grown = realloc(entries, capacity * sizeof(conv_cache_entry));
+			if (!grown) {
+				break;
+			}
+			entries = grown;
+		}
+		strcpy(entries[count].name, de->d_name);
+		entries[count].size = st.st_size;
+		entries[count].mtime = st.st_mtime;
+		total += st.st_size;
+		count++;
+	}
+	closedir(d);
+
+	if (total > max_bytes) {
+		qsort(entries, count, sizeof(conv_cache_entry), conv_cache_older);
+		for (int i = 0; i < count && total > max_bytes; i++) {
+			snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+			if (unlink(path) == 0) {
+				total -= entries[i].size;
+			}
+		}
+	}
+	free(entries);
+	return total;
+}
+
+/* Store an encoded image under path; a temporary file plus rename keeps
+concurrent runs from seeing half written entries. Returns 1 on success */
+static int conv_cache_put(const char *path, const void *data, int size) {
+	char tmp[4096 + 32];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	f = fopen(tmp, "wb");
+	if (!f) {
+		return 0;
+	}
+	if (fwrite(data, 1, size, f) != (size_t)size) {
+		fclose(f);
+		unlink(tmp);
+		return 0;
+	}
+	fclose(f);
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+/* Count a hit or a miss and the bytes stored in dir/stats, and evict if the
+total passes max_bytes; all under a lock */
+static void conv_cache_count(const char *dir, int hit, int stored, long long max_bytes, int verbose) {
+	unsigned long long hits = 0, misses = 0;
+	long long total = 0;
+	struct flock lock = {0};
+	char path[4096], line[96];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		return;
+	}
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	if (fcntl(fd, F_SETLKW, &lock) == 0) {
+		len = (int)read(fd, line, sizeof(line) - 1);
+		line[len > 0 ? len : 0] = '\0';
+		int known = sscanf(line, "%llu %llu %lld", &hits, &misses, &total) == 3;
+		hits += hit;
+		misses += !hit;
+		total += stored;
+		if (!known || total > max_bytes) {
+			total = conv_cache_evict(dir, total > max_bytes ? (long long)(max_bytes * CONV_CACHE_LOW) : max_bytes);
+		}
+		len = snprintf(line, sizeof(line), "%llu %llu %lld\n", hits, misses, total);
+		/* A stats file that couldn't be rewritten is dropped, the next run
+		then rescans the dir for the total */
+		if (lseek(fd, 0, SEEK_SET) != 0 || write(fd, line, len) != len || ftruncate(fd, len) != 0) {
+			unlink(path);
+		}
+	}
+	close(fd);
+
+	if (verbose) {
+		printf(
+			"cache %s, %llu hits, %llu misses (%.1f%% hits)\n", hit ? "hit" : "miss",
+			hits, misses, (double)hits / (hits + misses) * 100.0
+		);
+	}
+}
+
+#endif /* CONV_CACHE */
+
+#ifdef CONV_SERVE
+
+/* Server mode: qoiconv_cpr -serve <socket> keeps the converter loaded and
+takes requests over a Unix domain socket, so a conversion costs no process
+start. All connections sit in one epoll set; a worker thread takes the next
+request that is ready, serves it and hands the connection back, so idle
+clients don't hold a worker.
+
+A request is a conv_request, followed by the input file's bytes unless a
+file descriptor to them (a memfd or the file itself) comes along with
+SCM_RIGHTS. The server maps a memfd sealed against shrinking and writes and
+reads anything else, as a client could truncate a mapped file under it. The
+reply is a conv_reply and, on success, a memfd holding the converted file.
+Both ends are the same binary, so the structs go over as they are. */
+
+#define CONV_MAGIC 0x71637631 /* "qcv1" */
+
+/* Seconds a connection may stall in the middle of a request */
+#define CONV_TIMEOUT 10
+
+enum { CONV_QOI, CONV_PNG, CONV_JPG };
+
+typedef struct {
+	unsigned int magic;
+	int format;
+	int size;
+	int colorspace;
+	int quality;
+	qoi_cpr_cfg cfg;
+} conv_request;
+
+typedef struct {
+	int status;
+	int size;
+} conv_reply;
+
+/* Send len bytes and, if fd >= 0, the descriptor with them */
+static int conv_send(int sock, const void *buf, int len, int fd) {
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {(void *)buf, (size_t)len};
+	struct msghdr msg = {0};
+	int sent = 0;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		struct cmsghdr *cmsg;
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	while (sent < len) {
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (n <= 0) {
+			return 0;
+		}
+		sent += n;
+		iov.iov_base = (char *)buf + sent;
+		iov.iov_len = len - sent;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+	return 1;
+}
+
+/* Receive exactly len bytes; *fd is set to a passed descriptor or -1 */
+static int conv_recv(int sock, void *buf, int len, int *fd) {
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int got = 0;
+
+	*fd = -1;
+	while (got < len) {
+		struct iovec iov = {(char *)buf + got, (size_t)(len - got)};
+		struct msghdr msg = {0};
+		struct cmsghdr *cmsg;
+		ssize_t n;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (n <= 0) {
+			break;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && *fd < 0) {
+				memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		got += n;
+	}
+	if (got < len && *fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+	return got == len;
+}
+
+static void conv_write_fd(void *context, void *data, int size) {
+	int fd = *(int *)context;
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n <= 0) {
+			return;
+		}
+		data = (char *)data + n;
+		size -= n;
+	}
+}
+
+/* Convert one input file in memory into a new memfd; returns the memfd or -1 */
+static int conv_process(const conv_request *req, const unsigned char *data, int size) {
+	void *pixels = NULL;
+	qoi_desc desc;
+	size_t offset;
+	int w, h, channels, ok = 0, owned = 1;
+	int out = memfd_create("qoiconv_cpr", MFD_CLOEXEC);
+
+	if (out < 0) {
+		return -1;
+	}
+
+	if (size >= 4 && memcmp(data, "qoif", 4) == 0) {
+		pixels = qoi_decode(data, size, &desc, 0);
+		w = desc.width;
+		h = desc.height;
+		channels = desc.channels;
+	}
+	else if ((offset = pnm_parse(data, size, &w, &h, &channels))) {
+		pixels = (void *)(data + offset);
+		owned = 0;
+	}
+	else if (stbi_info_from_memory(data, size, &w, &h, &channels)) {
+		channels = channels <= 3 ? 3 : 4;
+		pixels = stbi_load_from_memory(data, size, &w, &h, NULL, channels);
+	}
+
+	if (pixels) {
+		if (req->format == CONV_QOI) {
+			qoi_cpr_cfg cfg = req->cfg;
+			void *encoded;
+			int len;
+
+			cfg.map = NULL;
+			cfg.map_block = 0;
+			cfg.map_stride = 0;
+			desc.width = w;
+			desc.height = h;
+			desc.channels = channels;
+			desc.colorspace = req->colorspace;
+			encoded = qoi_cpr_encode(pixels, &desc, &cfg, &len);
+			if (encoded) {
+				conv_write_fd(&out, encoded, len);
+				ok = 1;
+			}
+			free(encoded);
+		}
+		else if (req->format == CONV_PNG) {
+			ok = stbi_write_png_to_func(conv_write_fd, &out, w, h, channels, pixels, 0);
+		}
+		else if (req->format == CONV_JPG) {
+			ok = stbi_write_jpg_to_func(conv_write_fd, &out, w, h, channels, pixels, req->quality);
+		}
+		if (owned) {
+			free(pixels);
+		}
+	}
+
+	if (!ok) {
+		close(out);
+		return -1;
+	}
+	return out;
+}
+
+/* The input a client passed as fd, of at least size bytes. Sets *mapped if
+it is mapped rather than read into a malloc()ed buffer */
+static unsigned char *conv_input(int fd, int size, int *mapped) {
+	const int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+	unsigned char *data;
+	struct stat st;
+	int got = 0;
+
+	*mapped = 0;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < size) {
+		return NULL;
+	}
+	if ((fcntl(fd, F_GET_SEALS) & seals) == seals) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		*mapped = data != MAP_FAILED;
+		return *mapped ? data : NULL;
+	}
+
+	data = malloc(size);
+	if (!data || lseek(fd, 0, SEEK_SET) != 0) {
+		free(data);
+		return NULL;
+	}
+	while (got < size) {
+		ssize_t n = read(fd, data + got, size - got);
+		if (n <= 0) {
+			free(data);
+			return NULL;
+		}
+		got += n;
+	}
+	return data;
+}
+
+/* Serve one request on sock; returns 0 if the connection is to be closed */
+static int conv_serve_request(int sock) {
+	conv_request req;
+	conv_reply reply = {1, 0};
+	unsigned char *data = NULL;
+	int in_fd, out = -1, mapped = 0, ok;
+
+	if (!conv_recv(sock, &req, sizeof(req), &in_fd)) {
+		return 0;
+	}
+	if (req.magic != CONV_MAGIC || req.size <= 0) {
+		if (in_fd >= 0) {
+			close(in_fd);
+		}
+		return 0;
+	}
+
+	if (in_fd >= 0) {
+		data = conv_input(in_fd, req.size, &mapped);
+		close(in_fd);
+	}
+	else {
+		int fd;
+		data = malloc(req.size);
+		if (!data || !conv_recv(sock, data, req.size, &fd)) {
+			free(data);
+			return 0;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	if (data) {
+		out = conv_process(&req, data, req.size);
+		if (mapped) {
+			munmap(data, req.size);
+		}
+		else {
+			free(data);
+		}
+	}
+
+	if (out >= 0) {
+		struct stat st;
+		fstat(out, &st);
+		reply.status = 0;
+		reply.size = (int)st.st_size;
+	}
+	ok = conv_send(sock, &reply, sizeof(reply), out);
+	if (out >= 0) {
+		close(out);
+	}
+	return ok;
+}
+
+typedef struct {
+	int listener;
+	int epoll;
+} conv_pool;
+
+/* Each connection is registered with EPOLLONESHOT, so exactly one worker
+gets its next request and re-arms it when done */
+static void *conv_worker(void *arg) {
+	const conv_pool *pool = (const conv_pool *)arg;
+	const struct timeval timeout = {CONV_TIMEOUT, 0};
+
+	for (;;) {
+		struct epoll_event ev;
+		int sock;
+
+		if (epoll_wait(pool->epoll, &ev, 1, -1) != 1) {
+			continue;
+		}
+		if (ev.data.fd == pool->listener) {
+			sock = accept4(pool->listener, NULL, NULL, SOCK_CLOEXEC);
+			if (sock < 0) {
+				continue;
+			}
+			setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.fd = sock;
+			if (epoll_ctl(pool->epoll, EPOLL_CTL_ADD, sock, &ev) < 0) {
+				close(sock);
+			}
+			continue;
+		}
+
+		sock = ev.data.fd;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		if (!conv_serve_request(sock) || epoll_ctl(pool->epoll, EPOLL_CTL_MOD, sock, &ev) < 0) {
+			close(sock);
+		}
+	}
+	return NULL;
+}
+
+static int conv_socket(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+static int conv_serve(const char *path, int threads) {
+	static conv_pool pool;
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct stat st;
+	mode_t mask;
+	int bound;
+
+	pool.listener = conv_socket(path, &addr);
+	if (pool.listener < 0) {
+		printf("Couldn't create socket %s\n", path);
+		return 1;
+	}
+
+	/* Replace a stale socket of an earlier run, but nothing else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			printf("%s exists and is not a socket\n", path);
+			return 1;
+		}
+		unlink(path);
+	}
+
+	/* Only this user may connect */
+	mask = umask(0177);
+	bound = bind(pool.listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || listen(pool.listener, 64) < 0) {
+		printf("Couldn't listen on %s\n", path);
+		return 1;
+	}
+	fcntl(pool.listener, F_SETFL, O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+
+	pool.epoll = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = pool.listener;
+	if (pool.epoll < 0 || epoll_ctl(pool.epoll, EPOLL_CTL_ADD, pool.listener, &ev) < 0) {
+		printf("Couldn't create the epoll set\n");
+		return 1;
+	}
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		threads = threads > 0 ? threads : 1;
+	}
+	printf("Serving on %s with %d threads\n", path, threads);
+	fflush(stdout);
+
+	for (int t = 1; t < threads; t++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, conv_worker, &pool) != 0) {
+			printf("Couldn't start thread %d\n", t);
+			return 1;
+		}
+		pthread_detach(thread);
+	}
+	conv_worker(&pool);
+	return 0;
+}
+
+static double conv_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Send infile to the server at path and store the result in outfile. The
+input file's descriptor is passed as is, so its bytes don't go through the
+socket. With repeat > 1 the request is sent that often over the same
+connection to measure the latency. */
+static int conv_client(const char *path, const char *infile, const char *outfile, conv_request *req, int repeat, int verbose) {
+	struct sockaddr_un addr;
+	struct stat st;
+	double best = 1e9, total = 0;
+	int sock, in, encoded = 0;
+
+	in = open(infile, O_RDONLY | O_CLOEXEC);
+	if (in < 0 || fstat(in, &st) < 0 || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+		printf("Couldn't read %s\n", infile);
+		return 0;
+	}
+	req->size = (int)st.st_size;
+
+	sock = conv_socket(path, &addr);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("Couldn't connect to %s\n", path);
+		return 0;
+	}
+
+	for (int i = 0; i < repeat; i++) {
+		conv_reply reply;
+		double t = conv_now();
+		int out;
+
+		if (
+			!conv_send(sock, req, sizeof(*req), in) ||
+			!conv_recv(sock, &reply, sizeof(reply), &out)
+		) {
+			printf("Lost the connection to %s\n", path);
+			break;
+		}
+		t = conv_now() - t;
+		best = t < best ? t : best;
+		total += t;
+
+		if (reply.status != 0 || out < 0) {
+			if (out >= 0) {
+				close(out);
+			}
+			break;
+		}
+
+		if (i == repeat - 1) {
+			void *data = mmap(NULL, reply.size, PROT_READ, MAP_PRIVATE, out, 0);
+			FILE *f = data != MAP_FAILED ? fopen(outfile, "wb") : NULL;
+			if (f) {
+				encoded = fwrite(data, 1, reply.size, f) == (size_t)reply.size;
+				fclose(f);
+			}
+			if (data != MAP_FAILED) {
+				munmap(data, reply.size);
+			}
+		}
+		close(out);
+	}
+
+	if (encoded && (verbose || repeat > 1)) {
+		printf("%d requests, latency min %.1f us, avg %.1f us\n", repeat, best * 1e6, total / repeat * 1e6);
+	}
+	close(sock);
+	close(in);
+	return encoded;
+}
+
+#endif /* CONV_SERVE */
+
 int main(int argc, char **argv) {
+	#ifdef CONV_SERVE
+		if (argc >= 3 && strcmp(argv[1], "-serve") == 0) {
+			int threads = 0;
+			if (argc >= 5 && strcmp(argv[3], "-j") == 0) {
+				threads = atoi(argv[4]);
+			}
+			return conv_serve(argv[2], threads);
+		}
+	#endif
+
 	if (argc < 3) {
 		printf("Usage: qoiconv_cpr <infile> <outfile> [options]\n");
+		printf("       qoiconv_cpr -serve <socket> [-j threads]\n");
+		printf("Inputs: png, jpeg, qoi, binary ppm/pam (8 bit RGB/RGBA), raw with -raw\n");
 		printf("Options:\n");
 		printf("  -w ..... RGBA channel weights (in percentage, default 60 100 40 100).\n");
 		printf("  -lo .... low contrast threshhold (default 0.6)\n");
 		printf("  -hi .... high contrast threshhold (default 48)\n");
 		printf("  -mul ... multiply alpha before comparison (default unmultiply)\n");
+		printf("  -e ..... effort, 1 fast, 2 normal, 3 lookahead, 4 trellis (default 2)\n");
+		printf("  -p ..... protect often hit index slots from being overwritten\n");
+		printf("  -v2 .... also use the pixels above and below for the local contrast\n");
+		printf("  -ycocg . measure the error as luma and chroma, -w then weights Y Co Cg A\n");
+		printf("  -tone .. scale the thresholds by the perceived lightness step of each pixel\n");
+		printf("  -linear  mark the input as linear (default sRGB), changes -tone\n");
+		printf("  -map ... gray png with one value per block of pixels that scales the\n");
+		printf("           thresholds, 128 = 1x, 0 = lossless (the block size follows from the size)\n");
+		printf("  -raw ... width height channels of a headerless RGB/RGBA input file\n");
 		printf("  -q ..... jpeg encode quality (default 95)\n");
+		#ifdef QOI_STATS
+			printf("  -v ..... print chunk statistics of the qoi en-/decoder and cache hits\n");
+		#else
+			printf("  -v ..... print cache hits and -c latency\n");
+		#endif
+		printf("  -cache . directory that keeps encoded .qoi files to reuse for the same\n");
+		printf("           pixels and options, the least recently used are evicted\n");
+		printf("  -cache-max  size limit of the -cache directory in MB (default 1024)\n");
+		printf("  -c ..... convert on the server listening on this socket (not with -map)\n");
+		printf("  -n ..... with -c, send the request this many times and print the latency\n");
 		printf("Examples\n");
 		printf("  qoiconv_cpr input.png output.qoi --weights 60 100 40 75 --lowthresh 0.5 --highthresh 24 --mulalpha\n");
 		printf("  qoiconv_cpr input.qoi output.png\n");
@@ -73,9 +885,24 @@ int main(int argc, char **argv) {
 		.weights = {0.6f, 1.f, 0.4f, 1.f},
 		.lothresh = 0.6f, 
 		.hithresh = 48.f,
-		.mulalpha = 0
+		.mulalpha = 0,
+		.effort = QOI_CPR_EFFORT_DEFAULT,
+		.protect = 0,
+		.vertical = 0,
+		.space = QOI_CPR_SPACE_RGB,
+		.tone = 0
 	};
+	int colorspace = QOI_SRGB;
 	int quality = 95;
+	int verbose = 0;
+	const char *map_path = NULL;
+	float *map = NULL;
+	int map_len = 0;
+	const char *server = NULL;
+	int repeat = 1;
+	const char *cache_dir = NULL;
+	long long cache_max = 1024ll << 20;
+	int raw_w = 0, raw_h = 0, raw_channels = 0;
 
 	int i = 3;
 	while (i < argc) {
@@ -95,6 +922,46 @@ int main(int argc, char **argv) {
 			config.hithresh = atof(argv[++i]);
 		}
 		else if (strcmp(argv[i], "-mul") == 0) { config.mulalpha = 1; }
+		else if (strcmp(argv[i], "-e") == 0) {
+			if (i + 1 >= argc) { printf("Missing -e arg\n"); exit(1); }
+			config.effort = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-p") == 0) { config.protect = 1; }
+		else if (strcmp(argv[i], "-v2") == 0) { config.vertical = 1; }
+		else if (strcmp(argv[i], "-ycocg") == 0) { config.space = QOI_CPR_SPACE_YCOCG; }
+		else if (strcmp(argv[i], "-tone") == 0) { config.tone = 1; }
+		else if (strcmp(argv[i], "-linear") == 0) { colorspace = QOI_LINEAR; }
+		else if (strcmp(argv[i], "-map") == 0) {
+			if (i + 1 >= argc) { printf("Missing -map arg\n"); exit(1); }
+			map_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "-v") == 0) { verbose = 1; }
+		else if (strcmp(argv[i], "-raw") == 0) {
+			if (i + 3 >= argc) { printf("Not enough -raw args\n"); exit(1); }
+			raw_w = atoi(argv[++i]);
+			raw_h = atoi(argv[++i]);
+			raw_channels = atoi(argv[++i]);
+			if (raw_w <= 0 || raw_h <= 0 || raw_channels < 3 || raw_channels > 4) {
+				printf("Invalid -raw size %s %s %s\n", argv[i - 2], argv[i - 1], argv[i]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-cache") == 0) {
+			if (i + 1 >= argc) { printf("Missing -cache arg\n"); exit(1); }
+			cache_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-cache-max") == 0) {
+			if (i + 1 >= argc) { printf("Missing -cache-max arg\n"); exit(1); }
+			cache_max = (long long)(atof(argv[++i]) * (1 << 20));
+		}
+		else if (strcmp(argv[i], "-c") == 0) {
+			if (i + 1 >= argc) { printf("Missing -c arg\n"); exit(1); }
+			server = argv[++i];
+		}
+		else if (strcmp(argv[i], "-n") == 0) {
+			if (i + 1 >= argc) { printf("Missing -n arg\n"); exit(1); }
+			repeat = atoi(argv[++i]);
+		}
 		else if (strcmp(argv[i], "-q") == 0) {
 			if (i + 1 >= argc) { printf("Missing -q arg\n"); exit(1); }
 			quality = atoi(argv[++i]);
@@ -103,9 +970,40 @@ int main(int argc, char **argv) {
 		i++;
 	}
 
+	if (server) {
+		#ifdef CONV_SERVE
+			conv_request req = {
+				.magic = CONV_MAGIC,
+				.format =
+					STR_ENDS_WITH(argv[2], ".qoi") ? CONV_QOI :
+					STR_ENDS_WITH(argv[2], ".png") ? CONV_PNG :
+					STR_ENDS_WITH(argv[2], ".jpg") || STR_ENDS_WITH(argv[2], ".jpeg") ? CONV_JPG : -1,
+				.colorspace = colorspace,
+				.quality = quality,
+				.cfg = config
+			};
+			if (map_path || cache_dir || raw_w) {
+				printf("-map, -cache and -raw can't be used with -c\n");
+				exit(1);
+			}
+			if (!conv_client(server, argv[1], argv[2], &req, repeat > 0 ? repeat : 1, verbose)) {
+				printf("Couldn't convert %s on %s\n", argv[1], server);
+				exit(1);
+			}
+			return 0;
+		#else
+			printf("-c is only supported on Linux\n");
+			exit(1);
+		#endif
+	}
+
 	void *pixels = NULL;
 	int w, h, channels;
-	if (STR_ENDS_WITH(argv[1], ".png") || STR_ENDS_WITH(argv[1], ".jpg") || STR_ENDS_WITH(argv[1], ".jpeg")) {
+	pnm_file raw_file = {0};
+	if (raw_w > 0 || STR_ENDS_WITH(argv[1], ".ppm") || STR_ENDS_WITH(argv[1], ".pam")) {
+		pixels = pnm_load(argv[1], raw_w, raw_h, raw_channels, &w, &h, &channels, &raw_file);
+	}
+	else if (STR_ENDS_WITH(argv[1], ".png") || STR_ENDS_WITH(argv[1], ".jpg") || STR_ENDS_WITH(argv[1], ".jpeg")) {
 		if(!stbi_info(argv[1], &w, &h, &channels)) {
 			printf("Couldn't read header %s\n", argv[1]);
 			exit(1);
@@ -118,7 +1016,32 @@ int main(int argc, char **argv) {
 	}
 	else if (STR_ENDS_WITH(argv[1], ".qoi")) {
 		qoi_desc desc;
-		pixels = qoi_read(argv[1], &desc, 0);
+		#ifdef QOI_STATS
+		if (verbose) {
+			FILE *f = fopen(argv[1], "rb");
+			int size = 0;
+			void *data = NULL;
+			if (f) {
+				fseek(f, 0, SEEK_END);
+				size = ftell(f);
+				fseek(f, 0, SEEK_SET);
+				data = malloc(size > 0 ? size : 1);
+				size = fread(data, 1, size, f);
+				fclose(f);
+			}
+
+			qoi_stats stats = {0};
+			pixels = data ? qoi_decode_stats(data, size, &desc, 0, &stats) : NULL;
+			free(data);
+			if (pixels) {
+				print_stats("qoi_decode", &stats, desc.width * desc.height);
+			}
+		}
+		else
+		#endif
+		{
+			pixels = qoi_read(argv[1], &desc, 0);
+		}
 		channels = desc.channels;
 		w = desc.width;
 		h = desc.height;
@@ -137,12 +1060,93 @@ int main(int argc, char **argv) {
 		encoded = stbi_write_jpg(argv[2], w, h, channels, pixels, quality);
 	}
 	else if (STR_ENDS_WITH(argv[2], ".qoi")) {
-		encoded = qoi_cpr_write(argv[2], pixels, &(qoi_desc){
+		if (map_path) {
+			int mw, mh;
+			unsigned char *gray = stbi_load(map_path, &mw, &mh, NULL, 1);
+			if (!gray) {
+				printf("Couldn't load %s\n", map_path);
+				exit(1);
+			}
+			config.map_block = (w + mw - 1) / mw;
+			config.map_stride = mw;
+			if (
+				(w + config.map_block - 1) / config.map_block != mw ||
+				(h + config.map_block - 1) / config.map_block != mh
+			) {
+				printf("The map %s (%dx%d) doesn't fit the image (%dx%d)\n", map_path, mw, mh, w, h);
+				exit(1);
+			}
+			map_len = mw * mh;
+			map = malloc(map_len * sizeof(float));
+			for (int m = 0; m < map_len; m++) {
+				map[m] = gray[m] / 128.f;
+			}
+			config.map = map;
+			free(gray);
+		}
+
+		qoi_desc desc = {
 			.width = w,
 			.height = h, 
 			.channels = channels,
-			.colorspace = QOI_SRGB
-		}, &config);
+			.colorspace = colorspace
+		};
+
+		char cache_path[4096];
+		int cache_hit = 0, cache_stored = 0;
+		if (cache_dir) {
+			#ifdef CONV_CACHE
+				mkdir(cache_dir, 0777);
+				snprintf(
+					cache_path, sizeof(cache_path), "%s/%016llx.qoi", cache_dir,
+					conv_cache_key(pixels, &desc, &config, map_len)
+				);
+				cache_hit = encoded = conv_cache_get(cache_path, argv[2], &desc);
+			#else
+				printf("-cache is not supported on this platform\n");
+				exit(1);
+			#endif
+		}
+
+		if (cache_hit) {
+			/* Copied from the cache */
+		}
+		else if (verbose || cache_dir) {
+			int size;
+			#ifdef QOI_STATS
+				qoi_stats stats = {0};
+				void *data = verbose
+					? qoi_cpr_encode_stats(pixels, &desc, &config, &size, &stats)
+					: qoi_cpr_encode(pixels, &desc, &config, &size);
+			#else
+				void *data = qoi_cpr_encode(pixels, &desc, &config, &size);
+			#endif
+			FILE *f = data ? fopen(argv[2], "wb") : NULL;
+			if (f) {
+				encoded = fwrite(data, 1, size, f) == (size_t)size;
+				fclose(f);
+				#ifdef QOI_STATS
+					if (verbose) {
+						print_stats("qoi_cpr_encode", &stats, w * h);
+					}
+				#endif
+			}
+			#ifdef CONV_CACHE
+				if (encoded && cache_dir && conv_cache_put(cache_path, data, size)) {
+					cache_stored = size;
+				}
+			#endif
+			free(data);
+		}
+		else {
+			encoded = qoi_cpr_write(argv[2], pixels, &desc, &config);
+		}
+
+		#ifdef CONV_CACHE
+			if (cache_dir && encoded) {
+				conv_cache_count(cache_dir, cache_hit, cache_stored, cache_max, verbose);
+			}
+		#endif
 	}
 
 	if (!encoded) {
@@ -150,6 +1154,12 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
-	free(pixels);
+	free(map);
+	if (raw_file.data) {
+		pnm_close(&raw_file);
+	}
+	else {
+		free(pixels);
+	}
 	return 0;
 	}
\ No newline at end of file
@@ -0,0 +1,210 @@
+/*
+
+Raw pixel input for qoiconv and qoiconv_cpr: binary ppm/pam files and
+headerless RGB/RGBA frames
+
+Include after qoi.h. Define PNM_MMAP (and _GNU_SOURCE or another POSIX
+feature macro before any system header) to map the input files instead of
+reading them into memory.
+
+qoi-compressor contributors - https://github.com/Raven1996/qoi-compressor
+
+
+-- LICENSE: The MIT License(MIT)
+
+Copyright(c) 2026 qoi-compressor contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef QOICONV_PNM_H
+#define QOICONV_PNM_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef PNM_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Raw pixel input: binary .ppm (P6) and .pam (P7, depth 3 or 4) with a
+maxval of 255, or headerless frames with -raw <width> <height> <channels>.
+These are already in the encoder's layout, so the file is mapped and the
+encoder reads the pixels where they lie. */
+
+typedef struct {
+	void *data;
+	size_t size;
+	int mapped;
+} pnm_file;
+
+/* Next whitespace separated token of a header, skipping # comments */
+static int pnm_token(const unsigned char *data, size_t size, size_t *p, char *token, int len) {
+	int n = 0;
+	while (*p < size) {
+		if (data[*p] == '#') {
+			while (*p < size && data[*p] != '\n') {
+				(*p)++;
+			}
+		}
+		else if (isspace(data[*p])) {
+			(*p)++;
+		}
+		else {
+			break;
+		}
+	}
+	while (*p < size && !isspace(data[*p]) && n < len - 1) {
+		token[n++] = data[(*p)++];
+	}
+	token[n] = '\0';
+	return n > 0;
+}
+
+/* Parse a PPM or PAM header; returns the offset of the pixels or 0 */
+static size_t pnm_parse(const unsigned char *data, size_t size, int *w, int *h, int *channels) {
+	char token[32];
+	size_t p = 0;
+	int maxval = 0;
+
+	*w = *h = *channels = 0;
+	if (!pnm_token(data, size, &p, token, sizeof(token))) {
+		return 0;
+	}
+	if (strcmp(token, "P6") == 0) {
+		*channels = 3;
+		if (!pnm_token(data, size, &p, token, sizeof(token))) { return 0; }
+		*w = atoi(token);
+		if (!pnm_token(data, size, &p, token, sizeof(token))) { return 0; }
+		*h = atoi(token);
+		if (!pnm_token(data, size, &p, token, sizeof(token))) { return 0; }
+		maxval = atoi(token);
+	}
+	else if (strcmp(token, "P7") == 0) {
+		for (;;) {
+			if (!pnm_token(data, size, &p, token, sizeof(token))) { return 0; }
+			if (strcmp(token, "ENDHDR") == 0) {
+				break;
+			}
+			char key[32];
+			strcpy(key, token);
+			if (!pnm_token(data, size, &p, token, sizeof(token))) { return 0; }
+			if (strcmp(key, "WIDTH") == 0) { *w = atoi(token); }
+			else if (strcmp(key, "HEIGHT") == 0) { *h = atoi(token); }
+			else if (strcmp(key, "DEPTH") == 0) { *channels = atoi(token); }
+			else if (strcmp(key, "MAXVAL") == 0) { maxval = atoi(token); }
+		}
+	}
+	else {
+		return 0;
+	}
+
+	/* A single whitespace character ends the header */
+	p++;
+	if (
+		*w <= 0 || *h <= 0 || maxval != 255 ||
+		*channels < 3 || *channels > 4 ||
+		(size_t)*h >= QOI_PIXELS_MAX / (size_t)*w ||
+		p > size || size - p < (size_t)*w * *h * *channels
+	) {
+		return 0;
+	}
+	return p;
+}
+
+static int pnm_open(const char *path, pnm_file *file) {
+	file->data = NULL;
+	file->size = 0;
+	file->mapped = 0;
+
+	#ifdef PNM_MMAP
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+		if (fd < 0) {
+			return 0;
+		}
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				file->data = data;
+				file->size = st.st_size;
+				file->mapped = 1;
+			}
+		}
+		close(fd);
+	#else
+		FILE *f = fopen(path, "rb");
+		long len;
+		if (!f) {
+			return 0;
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		if (len > 0 && (file->data = malloc(len))) {
+			file->size = fread(file->data, 1, len, f);
+		}
+		fclose(f);
+	#endif
+	return file->data != NULL;
+}
+
+static void pnm_close(pnm_file *file) {
+	#ifdef PNM_MMAP
+		if (file->mapped) {
+			munmap(file->data, file->size);
+			return;
+		}
+	#endif
+	free(file->data);
+}
+
+/* Map a .ppm/.pam file, or a raw file if raw_w > 0, and return a pointer to
+its pixels */
+static void *pnm_load(const char *path, int raw_w, int raw_h, int raw_channels, int *w, int *h, int *channels, pnm_file *file) {
+	size_t offset = 0;
+
+	if (!pnm_open(path, file)) {
+		return NULL;
+	}
+	if (raw_w > 0) {
+		*w = raw_w;
+		*h = raw_h;
+		*channels = raw_channels;
+		if (
+			raw_h <= 0 || raw_channels < 3 || raw_channels > 4 ||
+			(size_t)raw_h >= QOI_PIXELS_MAX / (size_t)raw_w ||
+			file->size < (size_t)raw_w * raw_h * raw_channels
+		) {
+			pnm_close(file);
+			return NULL;
+		}
+	}
+	else if (!(offset = pnm_parse(file->data, file->size, w, h, channels))) {
+		pnm_close(file);
+		return NULL;
+	}
+	return (unsigned char *)file->data + offset;
+}
+
+#endif /* QOICONV_PNM_H */
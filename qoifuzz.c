@@ -1,10 +1,13 @@
 /*
 
-clang fuzzing harness for qoi_decode
+clang fuzzing harness for qoi_decode, qoi_validate and qoi_probe
 
 Compile and run with: 
 	clang -fsanitize=address,fuzzer -g -O0 qoifuzz.c && ./a.out
 
+Add -DQOI_CRC to fuzz the integrity chunk as well. QOI_FORCE_ISA selects the
+qoi_validate chunk skipper under test.
+
 Dominic Szablewski - https://phoboslab.org
 
 
@@ -47,5 +50,30 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
 	if (decoded != NULL) {
 		free(decoded);
 	}
+
+	/* qoi_decode is more lenient than qoi_validate, so only one direction
+	holds: an image qoi_validate accepts must decode, with the header qoi_probe
+	reads. qoi_decode looks for the integrity chunk in the last bytes of the
+	buffer, so with QOI_CRC only hold it to that when nothing else trails the
+	stream */
+	qoi_desc probe_desc, valid_desc;
+	int probed = qoi_probe(data + 4, (int)(size - 4), &probe_desc);
+	int valid = qoi_validate(data + 4, (int)(size - 4), &valid_desc);
+	if (valid > (int)(size - 4)) {
+		abort();
+	}
+	if (valid && (!probed || memcmp(&probe_desc, &valid_desc, sizeof(qoi_desc)) != 0)) {
+		abort();
+	}
+	decoded = qoi_decode(data + 4, (int)(size - 4), &desc, 0);
+	#ifdef QOI_CRC
+		if (valid != (int)(size - 4) && valid + QOI_CRC_SIZE != (int)(size - 4)) {
+			valid = 0;
+		}
+	#endif
+	if (valid && (decoded == NULL || memcmp(&desc, &valid_desc, sizeof(qoi_desc)) != 0)) {
+		abort();
+	}
+	free(decoded);
 	return 0;
 }
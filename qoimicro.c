@@ -0,0 +1,512 @@
+/*
+
+Microbenchmarks for the hot kernels of qoi and qoi_cpr
+
+Runs each kernel on fixed, generated inputs and reports ns per op. Use this to
+measure a change to one kernel in isolation; use qoibench for whole images.
+The index scan uses the SIMD variant picked at runtime; compare variants with
+e.g. QOI_FORCE_ISA=scalar qoimicro scan
+
+Compile with:
+	gcc qoimicro.c -std=gnu99 -lm -O3 -o qoimicro
+
+qoi-compressor contributors - https://github.com/Raven1996/qoi-compressor
+
+
+-- LICENSE: The MIT License(MIT)
+
+Copyright(c) 2026 qoi-compressor contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QOI_IMPLEMENTATION
+#include "qoi_cpr.h"
+
+
+
+
+// -----------------------------------------------------------------------------
+// Cross platform high resolution timer
+// From https://gist.github.com/ForeverZer0/0a4f80fc02b96e19380ebb7a3debbee5
+
+#include <stdint.h>
+#if defined(__linux)
+	#define HAVE_POSIX_TIMER
+	#include <time.h>
+	#ifdef CLOCK_MONOTONIC
+		#define CLOCKID CLOCK_MONOTONIC
+	#else
+		#define CLOCKID CLOCK_REALTIME
+	#endif
+#elif defined(__APPLE__)
+	#define HAVE_MACH_TIMER
+	#include <mach/mach_time.h>
+#elif defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#endif
+
+static uint64_t ns() {
+	static uint64_t is_init = 0;
+#if defined(__APPLE__)
+		static mach_timebase_info_data_t info;
+		if (0 == is_init) {
+			mach_timebase_info(&info);
+			is_init = 1;
+		}
+		uint64_t now;
+		now = mach_absolute_time();
+		now *= info.numer;
+		now /= info.denom;
+		return now;
+#elif defined(__linux)
+		static struct timespec linux_rate;
+		if (0 == is_init) {
+			clock_getres(CLOCKID, &linux_rate);
+			is_init = 1;
+		}
+		uint64_t now;
+		struct timespec spec;
+		clock_gettime(CLOCKID, &spec);
+		now = spec.tv_sec * 1.0e9 + spec.tv_nsec;
+		return now;
+#elif defined(_WIN32)
+		static LARGE_INTEGER win_frequency;
+		if (0 == is_init) {
+			QueryPerformanceFrequency(&win_frequency);
+			is_init = 1;
+		}
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return (uint64_t) ((1e9 * now.QuadPart)	/ win_frequency.QuadPart);
+#endif
+}
+
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+#define ERROR(...) printf("abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); printf("\n"); exit(1)
+
+
+
+
+// -----------------------------------------------------------------------------
+// Dead code elimination barriers
+
+// MICRO_KEEP forces v to be materialized in a register at this point, so the
+// compiler can neither drop the computation nor merge or vectorize it across
+// loop iterations. Every kernel result ends up in micro_sink.
+
+#if defined(__GNUC__) || defined(__clang__)
+	#define MICRO_KEEP(v) __asm__ volatile("" : "+r"(v))
+	#define MICRO_NOINLINE __attribute__((noinline))
+#else
+	#define MICRO_KEEP(v) (micro_sink += (uint64_t)(v))
+	#define MICRO_NOINLINE
+#endif
+
+static volatile uint64_t micro_sink;
+
+
+
+
+// -----------------------------------------------------------------------------
+// Controlled inputs
+
+#define MICRO_PX_COUNT 4096
+#define MICRO_CHUNK_COUNT 16384
+
+static uint32_t micro_rand_state = 0x2545f491;
+
+static uint32_t micro_rand() {
+	micro_rand_state ^= micro_rand_state << 13;
+	micro_rand_state ^= micro_rand_state >> 17;
+	micro_rand_state ^= micro_rand_state << 5;
+	return micro_rand_state;
+}
+
+static unsigned char micro_clamp(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static qoi_rgba_t micro_near(qoi_rgba_t px, int range) {
+	px.rgba.r = micro_clamp(px.rgba.r + (int)(micro_rand() % (2 * range + 1)) - range);
+	px.rgba.g = micro_clamp(px.rgba.g + (int)(micro_rand() % (2 * range + 1)) - range);
+	px.rgba.b = micro_clamp(px.rgba.b + (int)(micro_rand() % (2 * range + 1)) - range);
+	return px;
+}
+
+enum {
+	MICRO_OP_RUN,
+	MICRO_OP_INDEX,
+	MICRO_OP_DIFF,
+	MICRO_OP_LUMA,
+	MICRO_OP_RGB,
+	MICRO_OP_RGBA,
+	MICRO_OP_MIXED
+};
+
+typedef struct {
+	// Pixel pairs for compare_color and the hash
+	qoi_rgba_t px[MICRO_PX_COUNT];
+	qoi_rgba_t px_cmp[MICRO_PX_COUNT];
+	float thresh[MICRO_PX_COUNT][2];
+	float alpha[MICRO_PX_COUNT];
+	qoi_cpr_cfg cfg;
+
+	// A full index; half of px_scan is within tolerance of some entry
+	qoi_rgba_t index[64];
+	qoi_rgba_t px_scan[MICRO_PX_COUNT];
+
+	// A smooth, noisy pixel row that yields a mix of DIFF, LUMA and RGB
+	qoi_rgba_t px_row[MICRO_PX_COUNT];
+
+	// Encoded streams that consist of a single op type
+	unsigned char *stream[MICRO_OP_MIXED + 1];
+	int stream_size[MICRO_OP_MIXED + 1];
+} micro_data_t;
+
+static micro_data_t micro;
+
+static const char *micro_op_names[] = {"run", "index", "diff", "luma", "rgb", "rgba", "mixed"};
+
+static void micro_build_stream(int op) {
+	int i, p = 0, pixels = 0;
+	int max_size = QOI_HEADER_SIZE + MICRO_CHUNK_COUNT * 5 + (int)sizeof(qoi_padding);
+	unsigned char *bytes = malloc(max_size);
+	if (!bytes) {
+		ERROR("malloc");
+	}
+
+	p = QOI_HEADER_SIZE;
+	for (i = 0; i < MICRO_CHUNK_COUNT; i++) {
+		int o = op != MICRO_OP_MIXED ? op : (int)(micro_rand() % MICRO_OP_MIXED);
+		switch (o) {
+			case MICRO_OP_RUN: {
+				int run = 1 + micro_rand() % 62;
+				bytes[p++] = QOI_OP_RUN | (run - 1);
+				pixels += run;
+				break;
+			}
+			case MICRO_OP_INDEX:
+				bytes[p++] = QOI_OP_INDEX | (micro_rand() % 64);
+				pixels++;
+				break;
+			case MICRO_OP_DIFF:
+				bytes[p++] = QOI_OP_DIFF | (micro_rand() % 64);
+				pixels++;
+				break;
+			case MICRO_OP_LUMA:
+				bytes[p++] = QOI_OP_LUMA | (micro_rand() % 64);
+				bytes[p++] = micro_rand();
+				pixels++;
+				break;
+			case MICRO_OP_RGB:
+				bytes[p++] = QOI_OP_RGB;
+				bytes[p++] = micro_rand();
+				bytes[p++] = micro_rand();
+				bytes[p++] = micro_rand();
+				pixels++;
+				break;
+			case MICRO_OP_RGBA:
+				bytes[p++] = QOI_OP_RGBA;
+				bytes[p++] = micro_rand();
+				bytes[p++] = micro_rand();
+				bytes[p++] = micro_rand();
+				bytes[p++] = micro_rand();
+				pixels++;
+				break;
+		}
+	}
+	memcpy(bytes + p, qoi_padding, sizeof(qoi_padding));
+	p += sizeof(qoi_padding);
+
+	// One row, so the decoder sees exactly the number of pixels the ops produce
+	int hp = 0;
+	qoi_write_32(bytes, &hp, QOI_MAGIC);
+	qoi_write_32(bytes, &hp, pixels);
+	qoi_write_32(bytes, &hp, 1);
+	bytes[hp++] = 4;
+	bytes[hp++] = QOI_SRGB;
+
+	micro.stream[op] = bytes;
+	micro.stream_size[op] = p;
+}
+
+static void micro_init() {
+	int i;
+
+	micro.cfg = (qoi_cpr_cfg){.weights = {1.f, 1.2f, 0.8f, 1.f}, .lothresh = 0.8f, .hithresh = 48.f, .mulalpha = 0};
+
+	for (i = 0; i < MICRO_PX_COUNT; i++) {
+		float contrast = (micro_rand() % 1024) / 1024.f;
+		micro.px[i].v = micro_rand();
+		micro.px_cmp[i] = micro_near(micro.px[i], 24);
+		micro.px_cmp[i].rgba.a = micro_clamp(micro.px[i].rgba.a + (int)(micro_rand() % 9) - 4);
+		micro.thresh[i][0] = micro.cfg.lothresh * (1 - contrast) + micro.cfg.hithresh * contrast;
+		micro.thresh[i][1] = micro.thresh[i][0];
+		micro.alpha[i] = micro.px[i].rgba.a / 255.f;
+	}
+
+	for (i = 0; i < 64; i++) {
+		micro.index[i].v = micro_rand();
+		micro.index[i].rgba.a = 255;
+	}
+	for (i = 0; i < MICRO_PX_COUNT; i++) {
+		if (i & 1) {
+			micro.px_scan[i] = micro_near(micro.index[micro_rand() % 64], 6);
+		}
+		else {
+			micro.px_scan[i].v = micro_rand();
+			micro.px_scan[i].rgba.a = 255;
+		}
+	}
+
+	qoi_rgba_t px = {.rgba = {.r = 128, .g = 128, .b = 128, .a = 255}};
+	for (i = 0; i < MICRO_PX_COUNT; i++) {
+		// Mostly small steps with the occasional edge
+		px = micro_near(px, (micro_rand() % 16) ? 3 : 40);
+		micro.px_row[i] = px;
+	}
+
+	for (i = 0; i <= MICRO_OP_MIXED; i++) {
+		micro_build_stream(i);
+	}
+}
+
+
+
+
+// -----------------------------------------------------------------------------
+// Kernels
+
+// Each kernel does a fixed amount of work on the inputs above and returns the
+// number of ops it performed.
+
+typedef int (*micro_kernel_fn)(int arg);
+
+static MICRO_NOINLINE int micro_hash(int arg) {
+	uint64_t sum = 0;
+	(void)arg;
+	for (int i = 0; i < MICRO_PX_COUNT; i++) {
+		qoi_rgba_t px = micro.px[i];
+		uint32_t h = QOI_COLOR_HASH(px) % 64;
+		MICRO_KEEP(h);
+		sum += h;
+	}
+	micro_sink += sum;
+	return MICRO_PX_COUNT;
+}
+
+static MICRO_NOINLINE int micro_compare(int arg) {
+	uint64_t sum = 0;
+	float score, score_sum = 0;
+	(void)arg;
+	for (int i = 0; i < MICRO_PX_COUNT; i++) {
+		int r = compare_color(micro.px[i], micro.alpha[i], micro.px_cmp[i], micro.thresh[i], &micro.cfg, &score);
+		MICRO_KEEP(r);
+		sum += r;
+		score_sum += score;
+	}
+	micro_sink += sum + (uint64_t)score_sum;
+	return MICRO_PX_COUNT;
+}
+
+static MICRO_NOINLINE int micro_scan(int arg) {
+	uint64_t sum = 0;
+	unsigned long long mask = arg ? ~0ULL : 0x1111111111111111ULL;
+	qoi_cpr_scan_fn scan = qoi_cpr_scan_select();
+#ifdef QOI_STATS
+	qoi_stats *stats = NULL;
+#endif
+	for (int i = 0; i < MICRO_PX_COUNT; i++) {
+		int index_pos = scan
+			? scan(micro.index, mask, micro.px_scan[i], 1.f, micro.thresh[i], &micro.cfg)
+			: qoi_cpr_scan_index(micro.index, mask, micro.px_scan[i], 1.f, micro.thresh[i], &micro.cfg QOI_STATS_ARG);
+		MICRO_KEEP(index_pos);
+		sum += index_pos;
+	}
+	micro_sink += sum;
+	return MICRO_PX_COUNT;
+}
+
+static MICRO_NOINLINE int micro_cascade(int arg) {
+	unsigned char bytes[8];
+	uint64_t sum = 0;
+	qoi_rgba_t px_stored = micro.px_row[0];
+#ifdef QOI_STATS
+	qoi_stats *stats = NULL;
+#endif
+	(void)arg;
+	for (int i = 0; i < MICRO_PX_COUNT; i++) {
+		int n = qoi_cpr_encode_delta(bytes, &px_stored, micro.px_row[i], 1.f, micro.thresh[i], &micro.cfg QOI_STATS_ARG);
+		MICRO_KEEP(n);
+		sum += n + bytes[0];
+	}
+	micro_sink += sum + px_stored.v;
+	return MICRO_PX_COUNT;
+}
+
+static MICRO_NOINLINE int micro_decode(int op) {
+	qoi_desc desc;
+	void *pixels = qoi_decode(micro.stream[op], micro.stream_size[op], &desc, 4);
+	if (!pixels) {
+		ERROR("qoi_decode %s stream", micro_op_names[op]);
+	}
+	micro_sink += ((unsigned char *)pixels)[desc.width * 4 - 1];
+	QOI_FREE(pixels);
+	return MICRO_CHUNK_COUNT;
+}
+
+typedef struct {
+	const char *name;
+	micro_kernel_fn fn;
+	int arg;
+} micro_kernel_t;
+
+static const micro_kernel_t micro_kernels[] = {
+	{"hash",         micro_hash,    0},
+	{"compare",      micro_compare, 0},
+	{"scan",         micro_scan,    1},
+	{"scan_sparse",  micro_scan,    0},
+	{"cascade",      micro_cascade, 0},
+	{"decode_run",   micro_decode,  MICRO_OP_RUN},
+	{"decode_index", micro_decode,  MICRO_OP_INDEX},
+	{"decode_diff",  micro_decode,  MICRO_OP_DIFF},
+	{"decode_luma",  micro_decode,  MICRO_OP_LUMA},
+	{"decode_rgb",   micro_decode,  MICRO_OP_RGB},
+	{"decode_rgba",  micro_decode,  MICRO_OP_RGBA},
+	{"decode_mixed", micro_decode,  MICRO_OP_MIXED},
+};
+
+
+
+
+// -----------------------------------------------------------------------------
+// Runner
+
+static int opt_reps = 101;
+static int opt_warmup_ms = 50;
+static int opt_csv = 0;
+
+static int micro_cmp_double(const void *a, const void *b) {
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static void micro_run(const micro_kernel_t *k) {
+	double *samples = malloc(opt_reps * sizeof(double));
+	int ops = 0;
+	if (!samples) {
+		ERROR("malloc");
+	}
+
+	// Warm up caches, branch predictors and clocks before measuring
+	uint64_t warmup_end = ns() + (uint64_t)opt_warmup_ms * 1000000;
+	do {
+		ops = k->fn(k->arg);
+	} while (ns() < warmup_end);
+
+	for (int i = 0; i < opt_reps; i++) {
+		uint64_t t = ns();
+		k->fn(k->arg);
+		samples[i] = (double)(ns() - t) / ops;
+	}
+	qsort(samples, opt_reps, sizeof(double), micro_cmp_double);
+
+	double min = samples[0];
+	double median = samples[opt_reps / 2];
+	double p90 = samples[(opt_reps * 9) / 10];
+
+	if (opt_csv) {
+		printf("%s,%d,%.4f,%.4f,%.4f\n", k->name, ops, min, median, p90);
+	}
+	else {
+		printf("%-14s %8d %10.3f %10.3f %10.3f %10.1f\n",
+			k->name, ops, min, median, p90, 1000.0 / median
+		);
+	}
+	free(samples);
+}
+
+int main(int argc, char **argv) {
+	const char **filters = calloc(argc, sizeof(char *));
+	int filters_len = 0;
+	int kernels_len = (int)(sizeof(micro_kernels) / sizeof(micro_kernels[0]));
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) { opt_reps = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) { opt_warmup_ms = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--csv") == 0) { opt_csv = 1; }
+		else if (argv[i][0] == '-') {
+			printf("Usage: qoimicro [options] [kernel...]\n");
+			printf("Options\n");
+			printf("    --reps N ....... number of timed repetitions, default %d\n", opt_reps);
+			printf("    --warmup ms .... untimed warm-up per kernel, default %d\n", opt_warmup_ms);
+			printf("    --csv .......... print name,ops,min,median,p90 (ns/op)\n");
+			printf("Kernels\n");
+			for (int k = 0; k < kernels_len; k++) {
+				printf("    %s\n", micro_kernels[k].name);
+			}
+			printf("\nExamples\n");
+			printf("    qoimicro\n");
+			printf("    qoimicro --reps 501 scan compare\n");
+			exit(1);
+		}
+		else { filters[filters_len++] = argv[i]; }
+	}
+	if (opt_reps < 1) {
+		ERROR("--reps must be at least 1");
+	}
+
+	micro_init();
+
+	const char *isa_names[] = {"scalar", "sse2", "sse42", "avx2", "avx512"};
+	if (!opt_csv) {
+		printf("isa: %s\n", isa_names[qoi_isa()]);
+	}
+
+	if (opt_csv) {
+		printf("kernel,ops,min,median,p90\n");
+	}
+	else {
+		printf("%-14s %8s %10s %10s %10s %10s\n", "kernel", "ops", "min ns/op", "med ns/op", "p90 ns/op", "Mops/s");
+	}
+
+	for (int k = 0; k < kernels_len; k++) {
+		int run = filters_len == 0;
+		for (int i = 0; i < filters_len; i++) {
+			if (strcmp(filters[i], micro_kernels[k].name) == 0) {
+				run = 1;
+			}
+		}
+		if (run) {
+			micro_run(&micro_kernels[k]);
+		}
+	}
+
+	for (int i = 0; i <= MICRO_OP_MIXED; i++) {
+		free(micro.stream[i]);
+	}
+	free(filters);
+	return 0;
+}